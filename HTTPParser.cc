@@ -186,6 +186,99 @@ member_assign<classT, memberT> assign(classT** dst, memberT classT::* var)
   return member_assign<classT, memberT>(dst, var);
 }
 
+// Proxy class that appends the byte range parsed so far to the list
+// of ranges in the request and clears it for the next one.
+
+class append_range
+{
+public:
+  append_range(HTTPRequest** r, ByteRange** b) : request(r), range(b) { }
+  void operator() (const char*, const char*) const
+  {
+    (*request)->ranges.push_back(**range);
+    **range = ByteRange();
+  }
+private:
+  HTTPRequest** request;
+  ByteRange**   range;
+};
+
+// Proxy class that starts a new element of an Accept-Encoding list: it
+// remembers the coding's name and resets its qvalue to the default.
+
+class begin_coding
+{
+public:
+  begin_coding(string* c, double* q) : coding(c), qvalue(q) { }
+  void operator() (const char* first, const char* last) const
+  {
+    coding->assign(first, last - first);
+    *qvalue = 1.0;
+  }
+private:
+  string* coding;
+  double* qvalue;
+};
+
+// Proxy class that records an element of an Accept-Encoding list once
+// its parameters have been parsed. Codings we don't know are ignored,
+// "*" stands for every coding not mentioned explicitly.
+
+class end_coding
+{
+public:
+  end_coding(const string* c, const double* q, unsigned int* s, unsigned int* a, bool* any)
+      : coding(c), qvalue(q), seen(s), accepted(a), accept_any(any)
+  {
+  }
+  void operator() (const char*, const char*) const
+  {
+    unsigned int bit;
+    if (strcasecmp(coding->c_str(), "gzip") == 0 || strcasecmp(coding->c_str(), "x-gzip") == 0)
+      bit = CODING_GZIP;
+    else if (strcasecmp(coding->c_str(), "br") == 0)
+      bit = CODING_BR;
+    else if (strcasecmp(coding->c_str(), "zstd") == 0)
+      bit = CODING_ZSTD;
+    else if (*coding == "*")
+    {
+      *accept_any = (*qvalue > 0.0);
+      return;
+    }
+    else
+      return;
+    *seen |= bit;
+    if (*qvalue > 0.0)
+      *accepted |= bit;
+    else
+      *accepted &= ~bit;
+  }
+private:
+  const string*       coding;
+  const double*       qvalue;
+  unsigned int*       seen;
+  unsigned int*       accepted;
+  bool*               accept_any;
+};
+
+// Proxy class that appends an entity tag to the If-None-Match list of
+// the request. The weak indicator "W/" is dropped; If-None-Match uses
+// the weak comparison function anyway.
+
+class append_entity_tag
+{
+public:
+  append_entity_tag(HTTPRequest** r) : request(r) { }
+  void operator() (const char* first, const char* last) const
+  {
+    if (last - first > 2 && first[0] == 'W' && first[1] == '/')
+      first += 2;
+    (*request)->if_none_match.push_back(string(first, last - first));
+  }
+private:
+  HTTPRequest** request;
+};
+
 #if 0
 // Even though this class looks like another proxy class, it isn't.
 // This is basically another version of the ref() functor, but this one
@@ -227,7 +320,12 @@ HTTPParser::HTTPParser()
     name_ptr(0),
     data_ptr(0),
     url_ptr(0),
-    req_ptr(0)
+    req_ptr(0),
+    range_ptr(0),
+    qvalue(1.0),
+    codings_seen(0),
+    codings_accepted(0),
+    accept_any_coding(false)
 {
   CRLF          = CR >> LF;
   mark          = chset_t("-_.!~*'()");
@@ -293,16 +391,26 @@ HTTPParser::HTTPParser()
   asctime_date  = wkday >> SP >> date3 >> SP >> time >> SP >> uint_p[assign(tm_date.tm_year)];
   HTTP_date     = rfc1123_date | rfc850_date | asctime_date;
   If_Modified_Since_Header = HTTP_date;
-
-  // Initialize the global variables telling us our time zone and
-  // stuff. We'll need that to turn the GMT dates in the headers to
-  // local time.
-
-  tzset();
-  time_t ts   = 0;
-  tm gmt      = *gmtime(&ts);
-  tm local    = *localtime(&ts);
-  my_timezone = mktime(&local) - mktime(&gmt);
+  Byte_Range_Spec = ( uint_parser<off_t>()[assign(&range_ptr, &ByteRange::first)]
+                      >> '-' >> !uint_parser<off_t>()[assign(&range_ptr, &ByteRange::last)] )
+                    | ( '-' >> uint_parser<off_t>()[assign(&range_ptr, &ByteRange::last)] );
+  Range_Header  = nocase_d["bytes"] >> *LWS >> '=' >> *LWS
+                  >> Byte_Range_Spec[append_range(&req_ptr, &range_ptr)]
+                  >> *( *LWS >> ',' >> *LWS >> !Byte_Range_Spec[append_range(&req_ptr, &range_ptr)] )
+                  >> *LWS;
+  Entity_Tag    = !str_p("W/") >> '"' >> *( anychar_p - '"' ) >> '"';
+  If_None_Match_Header = ( str_p("*")[append_entity_tag(&req_ptr)]
+                           | ( Entity_Tag[append_entity_tag(&req_ptr)]
+                               >> *( *LWS >> ',' >> *LWS >> Entity_Tag[append_entity_tag(&req_ptr)] ) ) )
+                         >> *LWS;
+  Coding_Spec   = token[begin_coding(&coding, &qvalue)]
+                  >> *( *LWS >> ';' >> *LWS
+                        >> ( ( nocase_d["q"] >> '=' >> real_p[assign(qvalue)] )
+                             | ( token >> '=' >> ( token | quoted_string ) ) ) );
+  Accept_Encoding_Header = !Coding_Spec[end_coding(&coding, &qvalue, &codings_seen, &codings_accepted, &accept_any_coding)]
+                  >> *( *LWS >> ',' >> *LWS
+                        >> !Coding_Spec[end_coding(&coding, &qvalue, &codings_seen, &codings_accepted, &accept_any_coding)] )
+                  >> *LWS;
 }
 
 bool HTTPParser::have_complete_header_line(const string& input)
@@ -319,6 +427,11 @@ bool HTTPParser::have_complete_header_line(const string& input)
     return false;
 }
 
+bool HTTPParser::have_complete_request(const string& input)
+{
+  return input.find("\r\n\r\n") != string::npos;
+}
+
 bool HTTPParser::supports_persistent_connection(const HTTPRequest& request)
 {
   if (strcasecmp(request.connection.c_str(), "close") == 0)
@@ -366,6 +479,27 @@ size_t HTTPParser::parse_host_header(HTTPRequest& request, const std::string& in
     return 0;
 }
 
+/*
+  HTTP dates are always given in GMT, so we can't use mktime(), which
+  interprets its argument as local time. timegm() isn't portable, so
+  we count the days since the epoch ourselves. The tm structure must
+  hold the full year in tm_year, not the year minus 1900.
+*/
+
+static time_t gmt_to_time_t(const tm& date)
+{
+  // Count years from March on, so that the leap day comes last.
+
+  long year  = date.tm_year - (date.tm_mon < 2 ? 1 : 0);
+  long era   = (year >= 0 ? year : year - 399) / 400;
+  long yoe   = year - era * 400;
+  long doy   = (153 * ((date.tm_mon + 10) % 12) + 2) / 5 + date.tm_mday - 1;
+  long doe   = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  long days  = era * 146097 + doe - 719468;
+
+  return static_cast<time_t>(days) * 86400 + date.tm_hour * 3600 + date.tm_min * 60 + date.tm_sec;
+}
+
 size_t HTTPParser::parse_if_modified_since_header(HTTPRequest& request, const std::string& input) const
 {
   using namespace std;
@@ -393,7 +527,7 @@ size_t HTTPParser::parse_if_modified_since_header(HTTPRequest& request, const st
         return 0;
       break;
     case 1:
-      if (tm_date.tm_year % 4 == 0 && tm_date.tm_year % 100 != 0)
+      if ((tm_date.tm_year % 4 == 0 && tm_date.tm_year % 100 != 0) || tm_date.tm_year % 400 == 0)
       {
         if (tm_date.tm_mday > 29)
           return 0;
@@ -417,14 +551,86 @@ size_t HTTPParser::parse_if_modified_since_header(HTTPRequest& request, const st
 
   // The date is fine. Now turn it into a time_t.
 
-  tm_date.tm_year -= 1900;
-  request.if_modified_since = mktime(&tm_date) - my_timezone;
+  request.if_modified_since = gmt_to_time_t(tm_date);
 
   // Done.
 
   return info.length;
 }
 
+size_t HTTPParser::parse_range_header(HTTPRequest& request, const std::string& input) const
+{
+  req_ptr    = &request;
+  range_ptr  = &byte_range;
+  byte_range = ByteRange();
+  request.ranges.clear();
+
+  parse_info_t info = parse(input.data(), input.data() + input.size(), Range_Header);
+  if (!info.full)
+  {
+    request.ranges.clear();
+    return 0;
+  }
+
+  // A range whose last byte lies before its first byte makes the
+  // whole header invalid.
+
+  for (vector<ByteRange>::const_iterator i = request.ranges.begin(); i != request.ranges.end(); ++i)
+  {
+    if (!i->first.empty() && !i->last.empty() && i->last < i->first)
+    {
+      request.ranges.clear();
+      return 0;
+    }
+  }
+
+  return info.length;
+}
+
+size_t HTTPParser::parse_accept_encoding_header(HTTPRequest& request, const std::string& input) const
+{
+  codings_seen      = 0;
+  codings_accepted  = 0;
+  accept_any_coding = false;
+
+  parse_info_t info = parse(input.data(), input.data() + input.size(), Accept_Encoding_Header);
+  if (!info.full)
+    return 0;
+
+  unsigned int codings = codings_accepted;
+  if (accept_any_coding)
+    codings |= (CODING_GZIP | CODING_BR | CODING_ZSTD) & ~codings_seen;
+  request.accept_encoding = codings;
+
+  // An empty header is valid; it means the peer wants no coding at all.
+
+  return info.length > 0 ? info.length : 1;
+}
+
+size_t HTTPParser::parse_if_none_match_header(HTTPRequest& request, const std::string& input) const
+{
+  req_ptr = &request;
+  request.if_none_match.clear();
+
+  parse_info_t info = parse(input.data(), input.data() + input.size(), If_None_Match_Header);
+  if (!info.full)
+  {
+    request.if_none_match.clear();
+    return 0;
+  }
+  return info.length;
+}
+
+bool HTTPParser::if_none_match_applies(const HTTPRequest& request, const std::string& etag)
+{
+  for (vector<string>::const_iterator i = request.if_none_match.begin(); i != request.if_none_match.end(); ++i)
+  {
+    if (*i == "*" || *i == etag)
+      return true;
+  }
+  return false;
+}
+
 // And here comes the global parser instance.
 
 const HTTPParser http_parser;
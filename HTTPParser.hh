@@ -39,6 +39,11 @@ public:
 
   static bool have_complete_header_line(const std::string& input);
 
+  // Does the input contain a complete request header, i.e. the empty
+  // line that terminates it?
+
+  static bool have_complete_request(const std::string& input);
+
   // Does the given request allow a persistent connection?
 
   static bool supports_persistent_connection(const HTTPRequest& request);
@@ -55,6 +60,14 @@ public:
 
   size_t parse_host_header(HTTPRequest& request, const std::string& input) const;
   size_t parse_if_modified_since_header(HTTPRequest& request, const std::string& input) const;
+  size_t parse_range_header(HTTPRequest& request, const std::string& input) const;
+  size_t parse_accept_encoding_header(HTTPRequest& request, const std::string& input) const;
+  size_t parse_if_none_match_header(HTTPRequest& request, const std::string& input) const;
+
+  // Does the entity tag match any of the ones in the If-None-Match
+  // header? This uses the weak comparison function.
+
+  static bool if_none_match_applies(const HTTPRequest& request, const std::string& etag);
 
 private:                      // Don't copy me.
   HTTPParser(const HTTPParser&);
@@ -80,7 +93,9 @@ private:
   quoted_pair, qdtext, quoted_string, field_content,
   field_value, field_name, Header, Host_Header,
   date1, date2, date3, time, rfc1123_date, rfc850_date,
-  asctime_date, HTTP_date, If_Modified_Since_Header;
+  asctime_date, HTTP_date, If_Modified_Since_Header,
+  Byte_Range_Spec, Range_Header, Coding_Spec, Accept_Encoding_Header,
+  Entity_Tag, If_None_Match_Header;
   symbol_t weekday, month, wkday;
 
 private:
@@ -92,12 +107,14 @@ private:
   mutable std::string* data_ptr;
   mutable URL*         url_ptr;
   mutable HTTPRequest* req_ptr;
+  mutable ByteRange*   range_ptr;
   mutable struct tm    tm_date;
-
-private:
-  // FreeBSD doesn't have the POSIX variable timezone. To work around this
-  // issue, we figure out the timezone ourselves and store it here.
-  int my_timezone;
+  mutable ByteRange    byte_range;
+  mutable std::string  coding;
+  mutable double       qvalue;
+  mutable unsigned int codings_seen;
+  mutable unsigned int codings_accepted;
+  mutable bool         accept_any_coding;
 };
 
 extern const HTTPParser http_parser;
@@ -19,7 +19,9 @@
 #define HTTPREQUEST_HH_INCLUDED
 
 #include <string>
+#include <vector>
 #include <ctime>
+#include <sys/types.h>
 #include "resetable-variable.hh"
 
 // This class contains the relevant information in an (HTTP) URL.
@@ -33,6 +35,28 @@ struct URL
 };
 
 
+// A byte range as specified in the Range header. "500-" leaves last
+// unset, "-500" is a suffix range that leaves first unset and stores
+// the suffix length in last.
+
+struct ByteRange
+{
+  resetable_variable<off_t>        first;
+  resetable_variable<off_t>        last;
+};
+
+
+// The content codings we can serve pre-compressed variants for. The
+// accept_encoding field of HTTPRequest is a bit set of these.
+
+enum content_coding_t
+{
+  CODING_GZIP = 1 << 0,
+  CODING_BR   = 1 << 1,
+  CODING_ZSTD = 1 << 2
+};
+
+
 // This class contains all relevant information in an HTTP request.
 
 struct HTTPRequest
@@ -47,6 +71,10 @@ struct HTTPRequest
   std::string                      connection;
   std::string                      keep_alive;
   resetable_variable<time_t>       if_modified_since;
+  std::vector<std::string>         if_none_match;
+  std::vector<ByteRange>           ranges;
+  std::string                      if_range;
+  resetable_variable<unsigned int> accept_encoding;
   std::string                      user_agent;
   std::string                      referer;
   resetable_variable<unsigned int> status_code;
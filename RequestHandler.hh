@@ -20,6 +20,8 @@
 
 #include <sstream>
 #include <string>
+#include <deque>
+#include <list>
 #include <ctime>
 #include <unistd.h>
 #include <sys/types.h>
@@ -28,15 +30,22 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include "libscheduler/scheduler.hh"
 #include "HTTPRequest.hh"
+#include "gzip-encoder.hh"
+#include "statistics.hh"
+#include "peer-table.hh"
+
+struct log_record;
 
 // This is the HTTP protocol driver class.
 
 class RequestHandler : public scheduler::event_handler
 {
 public:
-  explicit RequestHandler(scheduler& sched, int fd, const sockaddr_in& sin);
+  explicit RequestHandler(scheduler& sched, int fd, const sockaddr& peer_addr, bool peer_counted);
   virtual ~RequestHandler();
 
 private:
@@ -46,6 +55,10 @@ private:
 
   void reset();
 
+  // Remember who we're talking to.
+
+  void set_peer(const sockaddr& addr);
+
 private:
   // These are the callbacks required by the scheduler. These will
   // be called when the file descriptor we're registered for become
@@ -63,6 +76,16 @@ private:
   void go_to_read_mode();
   void go_to_write_mode();
 
+  // Is the peer reading the reply slower than --min-send-rate?
+
+  bool sending_too_slowly();
+
+  // Hold back partial frames while a reply is being assembled from
+  // several writes, and send them out once it's complete.
+
+  void cork();
+  void uncork();
+
 private:
   // The whole class is implemented as a state machine. Depending on
   // the contents of the state variable, the appropriate state
@@ -82,14 +105,62 @@ private:
   };
   state_t state;
 
+  // Every state transition charges the time since the last one to the
+  // state we're leaving. The coarse clock is good enough for that and
+  // costs next to nothing.
+
+  void account_state_time()
+  {
+    uint64_t now = monotonic_coarse_usec();
+    time_in_state[state] += now - state_entered;
+    state_entered         = now;
+    states_visited       |= 1u << state;
+  }
+
+  void set_state(state_t new_state)
+  {
+    account_state_time();
+    --connections_in_state[state];
+    ++connections_in_state[new_state];
+    state = new_state;
+  }
+
+  // Account for data that has gone out to the peer.
+
+  void bytes_written(size_t len)
+  {
+    server_stats.bytes_sent += len;
+    connection_bytes_sent   += len;
+    tokens                  -= len;
+    if (!pending_logs.empty())
+      log_pending_replies(false);
+    if (first_byte_sent == 0 && connection_bytes_sent > reply_start)
+      first_byte_sent = monotonic_usec();
+  }
+
+  // How much of the current reply has gone out. Replies to pipelined
+  // requests queue up in the write_buffer, so the current one starts
+  // at reply_start bytes into the connection.
+
+  uint64_t reply_bytes_sent() const
+  {
+    return (connection_bytes_sent > reply_start) ? connection_bytes_sent - reply_start : 0;
+  }
+
   typedef bool (RequestHandler::*state_fun_t)();
   static const state_fun_t state_handlers[];
 
   bool get_request_line();
+  bool read_proxy_header();
   bool get_request_header();
   bool get_request_body();
   bool setup_reply();
   bool copy_file();
+  bool copy_mapped_file();
+  bool copy_memory_body();
+#ifdef HAVE_LIBZ
+  bool copy_compressed_file();
+#endif
   bool flush_buffer();
   bool terminate();
 
@@ -107,11 +178,54 @@ private:
   void moved_permanently(const std::string& path);
   void file_not_found();
   void not_modified();
+  void range_not_satisfiable();
+  void too_many_requests();
+  void server_status();
+
+  // Multi-range replies precede every part with this header.
+
+  std::string byterange_part_header(const ByteRange& range) const;
+
+  // Try to write a reply that is complete in the write_buffer without
+  // going through the scheduler.
+
+  bool send_immediately();
+
+  // Helpers of setup_reply().
+
+  void decide_persistence();
+  bool setup_packed_reply(const char* path, size_t path_len);
+
+  // Helpers of copy_file(): choose how to read the file and tell the
+  // kernel about it.
+
+  void prepare_copy_file();
+  void drop_behind_cursor();
+  void unmap_file();
+
+  // How much of the reply body we may send now, and what to do when
+  // that's nothing.
+
+  size_t write_budget(off_t remaining);
+  bool   throttle();
 
 private:
-  // The routine for making the logfile entries.
+  // The routine for making the logfile entries. It also adds the
+  // request to the server statistics.
+
+  void log_access(bool aborted = false);
+  void record_statistics(const HTTPRequest& req, uint64_t start, uint64_t first_byte,
+                         const uint64_t state_time[], unsigned int visited,
+                         uint64_t& total_time, uint64_t& time_to_first_byte);
+  void write_access_log(const log_record& rec);
 
-  void log_access();
+  // A reply that's queued behind others is logged -- and counted in
+  // the statistics -- once it has been written; until then, its entry
+  // waits in pending_logs. On abort, the remaining entries are logged
+  // with what made it out.
+
+  void queue_access_log();
+  void log_pending_replies(bool aborted);
 
 private:
   // Our I/O interface.
@@ -126,8 +240,80 @@ private:
   // Information associated with the HTTP request.
 
   char         peer_address[64];
+  peer_key     peer;
+  bool         peer_counted;    // does this connection count in the peer table?
+  bool         peer_is_local;
+
+  // Connections through a Unix domain socket come from a proxy on this
+  // host, which may tell us the real peer's address in a PROXY
+  // protocol header ahead of the first request. They're not TCP
+  // connections, so there's nothing to cork or to set TCP_NODELAY on.
+
+  bool         tcp_socket;
+  bool         expect_proxy_header;
   HTTPRequest  request;
+  unsigned int header_size;
+  unsigned int header_count;
   bool         use_persistent_connection;
+  bool         corked;
+  bool         nodelay;
+
+  // The token bucket of the bandwidth cap: how many bytes we may send,
+  // and when we last added to that. While throttled, we wait for the
+  // bucket to fill up again.
+
+  int64_t      tokens;
+  uint64_t     tokens_updated;
+  bool         throttled;
+
+  // When the request's first byte arrived and when the first byte of
+  // the reply went out, as given by monotonic_usec(). Zero means "not
+  // yet".
+
+  uint64_t     request_start;
+  uint64_t     first_byte_sent;
+
+  // The peer must have sent the request header by read_deadline, as given by
+  // monotonic_coarse_usec(); zero means no deadline. The send rate is
+  // measured in windows that started at rate_window_start, when
+  // rate_window_bytes of the reply had been sent.
+
+  uint64_t     read_deadline;
+  uint64_t     rate_window_start;
+  uint64_t     rate_window_bytes;
+
+  // What goes into the access log besides the request itself. The
+  // current reply starts reply_start bytes into the connection.
+
+  uint64_t     connection_bytes_sent;
+  uint64_t     reply_start;
+  unsigned int requests_served;
+  const char*  cache_status;
+  bool         access_logged;
+
+  struct pending_log_entry
+  {
+    HTTPRequest  request;
+    std::string  content_encoding;
+    std::string  etag;
+    const char*  cache_status;
+    unsigned int keepalive_requests;
+    bool         persistent;
+    uint64_t     reply_start;
+    uint64_t     reply_end;
+    uint64_t     request_start;
+    uint64_t     first_byte_sent;
+    uint64_t     time_in_state[TERMINATE + 1];
+    unsigned int states_visited;
+  };
+  std::deque<pending_log_entry> pending_logs;
+
+  // How long the current request has spent in each state, and which
+  // states it has been in at all.
+
+  uint64_t     state_entered;
+  uint64_t     time_in_state[TERMINATE + 1];
+  unsigned int states_visited;
 
 private:
   // Information about the file associated with the request.
@@ -136,11 +322,76 @@ private:
   std::string filename;
   int         filefd;
   struct stat file_stat;
+  off_t       file_offset;
+  off_t       file_end;
+  bool        use_sendfile;
+  bool        use_mmap;
+  size_t      chunk_size;
+  size_t      next_range;
+  std::string multipart_boundary;
+  const char* content_type;
+  std::string content_encoding;
+  std::string etag;
+  bool        vary_on_encoding;
+
+  // Large files are dropped from the page cache behind the cursor;
+  // everything before dropped_offset is gone already. In mmap mode,
+  // [map_offset, map_offset + map_length) of the file is mapped at
+  // map_base.
+
+  bool        drop_behind;
+  off_t       dropped_offset;
+  char*       map_base;
+  off_t       map_offset;
+  size_t      map_length;
+
+private:
+  // A reply body that's already in memory, like a cached compressed
+  // variant, is sent from [memory_body, memory_body_end). The owner
+  // keeps that memory alive until we're done.
+
+  const char*                          memory_body;
+  const char*                          memory_body_end;
+  boost::shared_ptr<const std::string> memory_body_owner;
+
+  // Replies compressed on the fly run the file through the encoder.
+  // The output for files small enough to be cached is collected in
+  // compressed_copy and goes into the variant cache once complete.
+
+#ifdef HAVE_LIBZ
+  boost::scoped_ptr<gzip_encoder>      encoder;
+#endif
+  boost::shared_ptr<std::string>       compressed_copy;
+  size_t                               encoded_size;
+  bool                                 chunked;
+
+  // All instantiated RequestHandlers, so that we can close them when
+  // we're draining.
+
+  typedef std::list<RequestHandler*> instance_list_t;
+  static instance_list_t               all_instances;
+  instance_list_t::iterator            instance_pos;
 
 public:
-  // The number of instantiated RequestHandlers.
+  // The number of instantiated RequestHandlers, in total and by the
+  // state they're in.
 
   static unsigned int instances;
+  static unsigned int connections_in_state[TERMINATE + 1];
+  static const char* const state_names[TERMINATE + 1];
+
+  // While we're draining, connections close after the current reply.
+  // Connections waiting for another request are closed right away,
+  // the rest when the drain timeout expires. Both return the number of
+  // connections closed.
+
+  static bool draining;
+  static unsigned int close_idle_connections();
+  static unsigned int close_all_connections();
+
+  // The distribution of the time requests spend in each state.
+
+  static log_histogram state_histograms[TERMINATE + 1];
 };
 
 #endif // HTTPD_HH_INCLUDED
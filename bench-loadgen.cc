@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   bench-loadgen -- a load generator for benchmarking httpd
+
+   The program keeps a number of keep-alive connections to a server
+   running on this machine busy with a mix of requests for a small
+   file, a large file, a file that doesn't exist, and a file that the
+   client already has (If-None-Match: *, answered with 304). With
+   --pipeline, several requests are written to a connection before the
+   first reply is read. The random mix is driven by a fixed seed, so
+   that every run sends the same sequence of requests.
+
+   At the end, it reports the throughput, the latency percentiles, and
+   the CPU time spent per request by itself and -- given --server-pid
+   on Linux -- by the server.
+*/
+
+#include <config.h>
+
+#include <algorithm>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "statistics.hh"
+#include "system-error.hh"
+
+using namespace std;
+
+enum request_kind { SMALL, LARGE, MISSING, NOT_MODIFIED, KINDS };
+
+static const char* const kind_names[KINDS] = { "small", "large", "404", "304" };
+
+// Command line parameters.
+
+static string        host            = "127.0.0.1";
+static unsigned int  port            = 8080;
+static string        virtual_host    = "localhost";
+static unsigned int  connection_count = 16;
+static unsigned long request_count   = 100000;
+static double        duration        = 0.0;
+static unsigned int  pipeline_depth  = 1;
+static unsigned int  mix[KINDS]      = { 70, 10, 10, 10 };
+static string        paths[KINDS]    = { "/small.html", "/large.bin", "/does-not-exist", "/small.html" };
+static long          server_pid      = 0;
+static unsigned long seed            = 1;
+
+#define USAGE_MSG \
+  "Usage: bench-loadgen [--host address] [--port number] [--virtual-host name]\n" \
+  "    [--connections n] [--requests n | --duration seconds] [--pipeline depth]\n" \
+  "    [--mix small,large,404,304] [--small-path path] [--large-path path]\n" \
+  "    [--missing-path path] [--server-pid pid] [--seed n]\n"
+
+// The state of one connection.
+
+struct outstanding_request
+{
+  request_kind kind;
+  uint64_t     sent_at;
+};
+
+struct connection
+{
+  int                             fd;
+  string                          output;
+  string                          input;
+  deque<outstanding_request>      outstanding;
+};
+
+// Results.
+
+static vector<uint64_t> latencies;
+static unsigned long    completed[KINDS];
+static unsigned long    unexpected_status;
+static unsigned long    reconnects;
+static uint64_t         body_bytes;
+static unsigned long    issued;
+
+// A small deterministic random number generator, so that runs are
+// reproducible no matter what the C library's rand() does.
+
+static unsigned long next_random()
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) & 0x7fff;
+}
+
+static request_kind pick_kind()
+{
+  unsigned int total = 0;
+  for (int i = 0; i < KINDS; ++i)
+    total += mix[i];
+  unsigned int r = next_random() % total;
+  for (int i = 0; i < KINDS; ++i)
+  {
+    if (r < mix[i])
+      return static_cast<request_kind>(i);
+    r -= mix[i];
+  }
+  return SMALL;
+}
+
+static void open_connection(connection& c)
+{
+  c.fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (c.fd == -1)
+    throw system_error("socket() failed");
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port   = htons(port);
+  if (inet_pton(AF_INET, host.c_str(), &sin.sin_addr) != 1)
+    throw invalid_argument("cannot parse host address '" + host + "'");
+  if (connect(c.fd, reinterpret_cast<sockaddr*>(&sin), sizeof(sin)) == -1)
+    throw system_error("cannot connect to " + host);
+  int true_flag = 1;
+  setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &true_flag, sizeof(int));
+  if (fcntl(c.fd, F_SETFL, O_NONBLOCK) == -1)
+    throw system_error("cannot set non-blocking mode");
+  c.output.clear();
+  c.input.clear();
+  c.outstanding.clear();
+}
+
+static bool want_more(uint64_t deadline)
+{
+  if (duration > 0.0)
+    return monotonic_usec() < deadline;
+  else
+    return issued < request_count;
+}
+
+static void issue_requests(connection& c, uint64_t deadline)
+{
+  while (c.outstanding.size() < pipeline_depth && want_more(deadline))
+  {
+    outstanding_request req;
+    req.kind    = pick_kind();
+    req.sent_at = monotonic_usec();
+    c.output += "GET " + paths[req.kind] + " HTTP/1.1\r\nHost: " + virtual_host + "\r\n";
+    if (req.kind == NOT_MODIFIED)
+      c.output += "If-None-Match: *\r\n";
+    c.output += "\r\n";
+    c.outstanding.push_back(req);
+    ++issued;
+  }
+}
+
+// Take complete replies off the front of the input buffer. Returns
+// false if the input is garbage.
+
+static bool parse_replies(connection& c)
+{
+  for (;;)
+  {
+    string::size_type header_end = c.input.find("\r\n\r\n");
+    if (header_end == string::npos)
+      return true;
+    if (c.input.compare(0, 9, "HTTP/1.1 ") != 0 || c.outstanding.empty())
+      return false;
+    unsigned int status = atoi(c.input.c_str() + 9);
+    unsigned long length = 0;
+    string::size_type pos = c.input.find("\r\nContent-Length: ");
+    if (pos != string::npos && pos < header_end)
+      length = strtoul(c.input.c_str() + pos + 18, 0, 10);
+    if (status == 304)
+      length = 0;
+    if (c.input.size() < header_end + 4 + length)
+      return true;
+    c.input.erase(0, header_end + 4 + length);
+
+    outstanding_request req = c.outstanding.front();
+    c.outstanding.pop_front();
+    static const unsigned int expected[KINDS] = { 200, 200, 404, 304 };
+    if (status != expected[req.kind])
+      ++unexpected_status;
+    ++completed[req.kind];
+    body_bytes += length;
+    latencies.push_back(monotonic_usec() - req.sent_at);
+  }
+}
+
+// The server closes the connection after an error reply. Requests we
+// had pipelined behind it are lost and will be issued again.
+
+static void reconnect(connection& c, uint64_t deadline)
+{
+  close(c.fd);
+  issued -= c.outstanding.size();
+  ++reconnects;
+  open_connection(c);
+  issue_requests(c, deadline);
+}
+
+static double cpu_seconds(const rusage& ru)
+{
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// The CPU time the server has used so far, according to /proc.
+
+static double server_cpu_seconds()
+{
+  if (server_pid == 0)
+    return 0.0;
+  char filename[64];
+  snprintf(filename, sizeof(filename), "/proc/%ld/stat", server_pid);
+  FILE* fh = fopen(filename, "r");
+  if (fh == 0)
+    return 0.0;
+  char buf[1024];
+  size_t len = fread(buf, 1, sizeof(buf) - 1, fh);
+  fclose(fh);
+  buf[len] = '\0';
+  const char* p = strrchr(buf, ')');
+  unsigned long utime = 0, stime = 0;
+  if (p == 0 || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    return 0.0;
+  return static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void parse_mix(const char* arg)
+{
+  unsigned int total = 0;
+  for (int i = 0; i < KINDS; ++i)
+  {
+    char* end;
+    mix[i] = strtoul(arg, &end, 10);
+    total += mix[i];
+    if (i < KINDS - 1 && *end != ',')
+      throw invalid_argument("--mix expects four comma-separated weights");
+    arg = end + 1;
+  }
+  if (total == 0)
+    throw invalid_argument("--mix weights must not all be zero");
+}
+
+static uint64_t percentile(double p)
+{
+  if (latencies.empty())
+    return 0;
+  size_t idx = static_cast<size_t>(p / 100.0 * (latencies.size() - 1) + 0.5);
+  return latencies[idx];
+}
+
+int main(int argc, char** argv)
+try
+{
+  const option longopts[] =
+  {
+    { "help",         no_argument,       0, 'h' },
+    { "host",         required_argument, 0, 'a' },
+    { "port",         required_argument, 0, 'p' },
+    { "virtual-host", required_argument, 0, 'H' },
+    { "connections",  required_argument, 0, 'c' },
+    { "requests",     required_argument, 0, 'n' },
+    { "duration",     required_argument, 0, 'd' },
+    { "pipeline",     required_argument, 0, 'P' },
+    { "mix",          required_argument, 0, 'm' },
+    { "small-path",   required_argument, 0, 's' },
+    { "large-path",   required_argument, 0, 'l' },
+    { "missing-path", required_argument, 0, 'x' },
+    { "server-pid",   required_argument, 0, 'S' },
+    { "seed",         required_argument, 0, 'r' },
+    { 0, 0, 0, 0 }
+  };
+  int rc;
+  while ((rc = getopt_long(argc, argv, "hp:c:n:d:P:", longopts, 0)) != -1)
+  {
+    switch (rc)
+    {
+      case 'a': host             = optarg;                     break;
+      case 'p': port             = strtoul(optarg, 0, 10);     break;
+      case 'H': virtual_host     = optarg;                     break;
+      case 'c': connection_count = strtoul(optarg, 0, 10);     break;
+      case 'n': request_count    = strtoul(optarg, 0, 10);     break;
+      case 'd': duration         = strtod(optarg, 0);          break;
+      case 'P': pipeline_depth   = strtoul(optarg, 0, 10);     break;
+      case 'm': parse_mix(optarg);                             break;
+      case 's': paths[SMALL]     = paths[NOT_MODIFIED] = optarg; break;
+      case 'l': paths[LARGE]     = optarg;                     break;
+      case 'x': paths[MISSING]   = optarg;                     break;
+      case 'S': server_pid       = strtol(optarg, 0, 10);      break;
+      case 'r': seed             = strtoul(optarg, 0, 10);     break;
+      case 'h':
+        fprintf(stderr, USAGE_MSG);
+        return 0;
+      default:
+        fprintf(stderr, USAGE_MSG);
+        return 1;
+    }
+  }
+  if (connection_count == 0 || pipeline_depth == 0)
+    throw invalid_argument("--connections and --pipeline must be at least 1");
+
+  signal(SIGPIPE, SIG_IGN);
+
+  vector<connection> conns(connection_count);
+  vector<pollfd>     pfds(connection_count);
+  for (size_t i = 0; i < conns.size(); ++i)
+    open_connection(conns[i]);
+
+  rusage ru_start;
+  getrusage(RUSAGE_SELF, &ru_start);
+  double   server_cpu_start = server_cpu_seconds();
+  uint64_t start            = monotonic_usec();
+  uint64_t deadline         = start + static_cast<uint64_t>(duration * 1000000);
+
+  for (size_t i = 0; i < conns.size(); ++i)
+    issue_requests(conns[i], deadline);
+
+  char buf[64 * 1024];
+  for (;;)
+  {
+    bool busy = false;
+    for (size_t i = 0; i < conns.size(); ++i)
+    {
+      pfds[i].fd     = conns[i].fd;
+      pfds[i].events = POLLIN | (conns[i].output.empty() ? 0 : POLLOUT);
+      busy = busy || !conns[i].outstanding.empty();
+    }
+    if (!busy)
+      break;
+    if (poll(&pfds[0], pfds.size(), 10000) <= 0)
+      throw runtime_error("the server did not answer within 10 seconds");
+
+    for (size_t i = 0; i < conns.size(); ++i)
+    {
+      connection& c = conns[i];
+      if (pfds[i].revents & POLLOUT)
+      {
+        ssize_t len = write(c.fd, c.output.data(), c.output.size());
+        if (len > 0)
+          c.output.erase(0, len);
+        else if (len == -1 && errno != EAGAIN && errno != EINTR)
+        {
+          reconnect(c, deadline);
+          continue;
+        }
+      }
+      if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+      {
+        ssize_t len = read(c.fd, buf, sizeof(buf));
+        if (len > 0)
+        {
+          c.input.append(buf, len);
+          if (!parse_replies(c))
+            throw runtime_error("received a malformed reply");
+          issue_requests(c, deadline);
+        }
+        else if (len == 0 || (errno != EAGAIN && errno != EINTR))
+          reconnect(c, deadline);
+      }
+    }
+  }
+
+  uint64_t elapsed = monotonic_usec() - start;
+  rusage ru_end;
+  getrusage(RUSAGE_SELF, &ru_end);
+  double server_cpu = server_cpu_seconds() - server_cpu_start;
+  double client_cpu = cpu_seconds(ru_end) - cpu_seconds(ru_start);
+  for (size_t i = 0; i < conns.size(); ++i)
+    close(conns[i].fd);
+
+  sort(latencies.begin(), latencies.end());
+  double seconds = elapsed / 1e6;
+  size_t total   = latencies.size();
+  if (total == 0)
+    throw runtime_error("no requests completed");
+
+  printf("connections:      %u (pipeline depth %u)\n", connection_count, pipeline_depth);
+  printf("requests:         %lu in %.3f s (", static_cast<unsigned long>(total), seconds);
+  for (int i = 0; i < KINDS; ++i)
+    printf("%s%s %lu", (i ? ", " : ""), kind_names[i], completed[i]);
+  printf(")\n");
+  printf("unexpected:       %lu status codes, %lu reconnects\n", unexpected_status, reconnects);
+  printf("throughput:       %.0f requests/s, %.2f MB/s of body data\n",
+         total / seconds, body_bytes / seconds / (1024 * 1024));
+  printf("latency (usec):   p50 %lu, p99 %lu, p999 %lu, max %lu\n",
+         static_cast<unsigned long>(percentile(50.0)), static_cast<unsigned long>(percentile(99.0)),
+         static_cast<unsigned long>(percentile(99.9)), static_cast<unsigned long>(latencies.back()));
+  printf("cpu per request:  %.2f usec client", client_cpu * 1e6 / total);
+  if (server_pid != 0)
+    printf(", %.2f usec server", server_cpu * 1e6 / total);
+  printf("\n");
+  return unexpected_status == 0 ? 0 : 1;
+}
+catch (const exception& e)
+{
+  fprintf(stderr, "bench-loadgen: %s\n", e.what());
+  return 1;
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   bench-micro -- microbenchmarks for the per-request code paths
+
+   Every request goes through the HTTP parser and a handful of string
+   utilities. This program runs a small corpus of real-world requests
+   -- a browser, curl, a crawler, and a client with a huge cookie --
+   through each of them and reports the time and the number of heap
+   allocations per operation. Name one or more benchmarks on the
+   command line to run only those.
+*/
+
+#include <config.h>
+
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include "HTTPParser.hh"
+#include "urldecode.hh"
+#include "escape-html-specials.hh"
+#include "search-and-replace.hh"
+#include "timestamp-to-string.hh"
+#include "log-format.hh"
+#include "statistics.hh"
+#include "config.hh"
+
+using namespace std;
+
+const configuration* config;
+
+// Count every allocation that goes through operator new.
+
+static unsigned long allocations = 0;
+
+void* operator new(size_t size) throw(std::bad_alloc)
+{
+  ++allocations;
+  void* p = malloc(size ? size : 1);
+  if (p == 0)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) throw()
+{
+  free(p);
+}
+
+// The request corpus.
+
+static const char* const request_corpus[] =
+{
+  // A browser.
+  "GET /blog/2016/04/mini-httpd-1.6.html HTTP/1.1\r\n"
+  "Host: www.example.org\r\n"
+  "Connection: keep-alive\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/50.0.2661.75 Safari/537.36\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,*/*;q=0.8\r\n"
+  "Referer: https://www.example.org/blog/\r\n"
+  "Accept-Encoding: gzip, deflate, sdch, br\r\n"
+  "Accept-Language: en-US,en;q=0.8,de;q=0.6\r\n"
+  "If-None-Match: \"1a2b3c-4d5e-57025f80.0\"\r\n"
+  "If-Modified-Since: Mon, 04 Apr 2016 12:34:56 GMT\r\n"
+  "\r\n",
+
+  // curl.
+  "GET /downloads/mini-httpd-1.6.tar.gz HTTP/1.1\r\n"
+  "Host: www.example.org:8080\r\n"
+  "User-Agent: curl/7.47.0\r\n"
+  "Accept: */*\r\n"
+  "Range: bytes=0-1023,4096-\r\n"
+  "\r\n",
+
+  // A crawler.
+  "GET /search?q=mini%20httpd&lang=en%2Cde HTTP/1.1\r\n"
+  "Host: www.example.org\r\n"
+  "Accept: */*\r\n"
+  "From: googlebot(at)googlebot.com\r\n"
+  "User-Agent: Mozilla/5.0 (compatible; Googlebot/2.1; +http://www.google.com/bot.html)\r\n"
+  "Accept-Encoding: gzip,deflate\r\n"
+  "\r\n",
+
+  // A client that carries a lot of cookies around.
+  "GET /app/dashboard/%7Euser/settings%3Ftab%3Dprofile HTTP/1.1\r\n"
+  "Host: app.example.org\r\n"
+  "User-Agent: Mozilla/5.0 (Windows NT 10.0; WOW64; rv:45.0) Gecko/20100101 Firefox/45.0\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Referer: http://app.example.org/app/dashboard/\r\n"
+  "Cookie: _ga=GA1.2.1234567890.1459771234; _gid=GA1.2.987654321.1459771234; "
+  "session=eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0NTY3ODkwIiwibmFtZSI6IkpvaG4gRG9lIiwiYWRtaW4iOnRydWV9."
+  "TJVA95OrM7E2cBab30RMHrHDcEfxjoYZgeFONFh7HgQTJVA95OrM7E2cBab30RMHrHDcEfxjoYZgeFONFh7HgQTJVA95OrM7E2cBab30RMHrHDcEf; "
+  "prefs=theme%3Ddark%26lang%3Den%26tz%3DEurope%2FBerlin%26density%3Dcompact%26notifications%3Doff; "
+  "tracking=aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\r\n"
+  "Connection: keep-alive\r\n"
+  "\r\n"
+};
+static const size_t corpus_size = sizeof(request_corpus) / sizeof(request_corpus[0]);
+
+// The pieces of the corpus, split up the way RequestHandler sees them.
+
+static vector<string> request_lines;
+static vector<string> header_blocks;
+static vector<string> paths;
+static vector<string> user_agents;
+
+static const char* const filenames[] =
+{
+  "/htdocs/www.example.org/index.html", "/htdocs/www.example.org/style.css",
+  "/htdocs/www.example.org/logo.png", "/htdocs/www.example.org/mini-httpd-1.6.tar.gz",
+  "/htdocs/www.example.org/README", "/htdocs/www.example.org/photo.JPG"
+};
+static const size_t filename_count = sizeof(filenames) / sizeof(filenames[0]);
+
+static void split_corpus()
+{
+  for (size_t i = 0; i < corpus_size; ++i)
+  {
+    string req = request_corpus[i];
+    string::size_type eol = req.find("\r\n");
+    request_lines.push_back(req.substr(0, eol + 2));
+    header_blocks.push_back(req.substr(eol + 2));
+
+    HTTPRequest r;
+    if (http_parser.parse_request_line(r, req) == 0)
+      throw logic_error("the corpus contains a malformed request line");
+    paths.push_back(r.url.path + (r.url.query.empty() ? "" : "?" + r.url.query) + "<&>");
+
+    string::size_type ua = req.find("User-Agent: ");
+    user_agents.push_back(req.substr(ua + 12, req.find("\r\n", ua) - ua - 12) + " \"quoted\"");
+  }
+}
+
+// The benchmarks. Each runs one operation and returns something that
+// depends on the result, so that the compiler can't optimize the work
+// away.
+
+static size_t bench_request_line(size_t n)
+{
+  HTTPRequest r;
+  return http_parser.parse_request_line(r, request_lines[n % corpus_size]);
+}
+
+static size_t bench_header_block(size_t n)
+{
+  HTTPRequest r;
+  string input = header_blocks[n % corpus_size];
+  size_t result = 0;
+  while (HTTPParser::have_complete_header_line(input))
+  {
+    string name, data;
+    size_t len = http_parser.parse_header(name, data, input);
+    if (len == 0)
+      break;
+    if (strcasecmp("Host", name.c_str()) == 0)
+      result += http_parser.parse_host_header(r, data);
+    else if (strcasecmp("If-Modified-Since", name.c_str()) == 0)
+      result += http_parser.parse_if_modified_since_header(r, data);
+    else if (strcasecmp("If-None-Match", name.c_str()) == 0)
+      result += http_parser.parse_if_none_match_header(r, data);
+    else if (strcasecmp("Range", name.c_str()) == 0)
+      result += http_parser.parse_range_header(r, data);
+    else if (strcasecmp("Accept-Encoding", name.c_str()) == 0)
+      result += http_parser.parse_accept_encoding_header(r, data);
+    input.erase(0, len);
+  }
+  return result;
+}
+
+static size_t bench_urldecode(size_t n)
+{
+  return urldecode(paths[n % corpus_size]).size();
+}
+
+static size_t bench_urldecode_path(size_t n)
+{
+  char buf[4096];
+  const string& path = paths[n % corpus_size];
+  return urldecode_path(path.data(), path.size(), buf, sizeof(buf));
+}
+
+static size_t bench_escape_html_specials(size_t n)
+{
+  return escape_html_specials(paths[n % corpus_size]).size();
+}
+
+static size_t bench_search_and_replace(size_t n)
+{
+  return search_and_replace(user_agents[n % corpus_size], "\"", "\\\"", true).size();
+}
+
+static size_t bench_time_to_rfcdate(size_t n)
+{
+  return time_to_rfcdate(1459771234 + n).size();
+}
+
+static size_t bench_get_content_type(size_t n)
+{
+  return strlen(config->get_content_type(filenames[n % filename_count]));
+}
+
+static size_t bench_log_format(size_t n)
+{
+  static HTTPRequest  r;
+  static string       empty;
+  static string       etag = "\"1a2b3c-4d5e-57025f80.0\"";
+  if (r.method.empty())
+  {
+    http_parser.parse_request_line(r, request_lines[0]);
+    r.user_agent    = user_agents[0];
+    r.referer       = "https://www.example.org/blog/";
+    r.start_up_time = 1459771234;
+    r.status_code   = 200;
+    r.object_size   = 12345;
+  }
+  log_record rec;
+  rec.peer_address       = "192.168.100.200";
+  rec.request            = &r;
+  rec.content_encoding   = &empty;
+  rec.etag               = &etag;
+  rec.cache_status       = 0;
+  rec.request_time       = 1234 + n % 100;
+  rec.time_to_first_byte = 567;
+  rec.bytes_sent         = 12600;
+  rec.keepalive_requests = n % 10;
+  rec.aborted            = false;
+  rec.persistent         = true;
+  string buf;
+  access_log_format.format(rec, buf);
+  return buf.size();
+}
+
+static const struct
+{
+  const char* name;
+  size_t (*run)(size_t);
+}
+benchmarks[] =
+{
+  { "request-line",         &bench_request_line },
+  { "header-block",         &bench_header_block },
+  { "urldecode",            &bench_urldecode },
+  { "urldecode-path",       &bench_urldecode_path },
+  { "escape-html-specials", &bench_escape_html_specials },
+  { "search-and-replace",   &bench_search_and_replace },
+  { "time-to-rfcdate",      &bench_time_to_rfcdate },
+  { "get-content-type",     &bench_get_content_type },
+  { "log-format",           &bench_log_format }
+};
+static const size_t benchmark_count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+static volatile size_t sink;
+
+// Run a benchmark for at least min_time microseconds, doubling the
+// number of iterations until it does.
+
+static void run_benchmark(const char* name, size_t (*run)(size_t), uint64_t min_time)
+{
+  size_t   iterations = 64;
+  uint64_t elapsed;
+  unsigned long allocs;
+  for (;;)
+  {
+    size_t result = 0;
+    unsigned long allocs_before = allocations;
+    uint64_t start = monotonic_usec();
+    for (size_t i = 0; i < iterations; ++i)
+      result += run(i);
+    elapsed = monotonic_usec() - start;
+    allocs  = allocations - allocs_before;
+    sink    = result;
+    if (elapsed >= min_time)
+      break;
+    iterations *= 2;
+  }
+  printf("%-22s %10.1f ns/op %8.2f allocs/op %12lu ops\n", name,
+         elapsed * 1000.0 / iterations, static_cast<double>(allocs) / iterations,
+         static_cast<unsigned long>(iterations));
+}
+
+int main(int argc, char** argv)
+try
+{
+  char* config_argv[] = { argv[0], 0 };
+  configuration real_config(1, config_argv);
+  config = &real_config;
+  access_log_format.compile(config->log_format);
+  split_corpus();
+
+  uint64_t min_time = 200000;
+  int first_name = 1;
+  if (argc > 2 && strcmp(argv[1], "--min-time") == 0)
+  {
+    min_time   = strtoul(argv[2], 0, 10) * 1000;
+    first_name = 3;
+  }
+
+  for (size_t i = 0; i < benchmark_count; ++i)
+  {
+    bool selected = (first_name == argc);
+    for (int j = first_name; j < argc; ++j)
+      if (strcmp(argv[j], benchmarks[i].name) == 0)
+        selected = true;
+    if (selected)
+      run_benchmark(benchmarks[i].name, benchmarks[i].run, min_time);
+  }
+  return 0;
+}
+catch (const exception& e)
+{
+  fprintf(stderr, "bench-micro: %s\n", e.what());
+  return 1;
+}
@@ -0,0 +1,533 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   bench-replay -- replay access logs against httpd
+
+   The program reads access logs in the default format httpd writes --
+   one "HOST-access" file per virtual host -- and sends the logged
+   requests to a server on this machine again. Requests from the same
+   peer go out one after another on one keep-alive connection, which
+   is closed when the peer was idle for longer than --keep-alive
+   seconds in the log; different peers run concurrently, up to
+   --connections at a time. With --speed 1 the requests are sent at
+   the times they were logged, --speed 10 replays ten times faster,
+   and --speed 0, the default, sends them as fast as possible.
+
+   To reproduce the logged replies, 304 entries are sent with
+   "If-None-Match: *", and 206 entries with a Range header for as many
+   bytes as the log says were sent. With --synthesize DIR, the program
+   doesn't replay anything but creates a document root in DIR that has
+   every file that was answered with 200, 206, or 304, in the largest
+   size the log mentions. Paths answered with 404 are left out.
+*/
+
+#include <config.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "urldecode.hh"
+#include "statistics.hh"
+#include "system-error.hh"
+
+using namespace std;
+
+// Command line parameters.
+
+static string       host             = "127.0.0.1";
+static unsigned int port             = 8080;
+static unsigned int max_connections  = 64;
+static double       speed            = 0.0;
+static long         keep_alive_gap   = 15;
+static string       synthesize_dir;
+
+#define USAGE_MSG \
+  "Usage: bench-replay [--host address] [--port number] [--connections n]\n" \
+  "    [--speed factor] [--keep-alive seconds] [--synthesize directory]\n" \
+  "    logfile ...\n"
+
+// One logged request.
+
+struct log_entry
+{
+  long          time;
+  size_t        order;
+  string        peer;
+  string        vhost;
+  string        method;
+  string        path;
+  unsigned int  status;
+  unsigned long size;
+
+  bool operator< (const log_entry& rhs) const
+  {
+    return time != rhs.time ? time < rhs.time : order < rhs.order;
+  }
+};
+
+static vector<log_entry> entries;
+
+// Convert "18/Oct/2016:17:33:45 -0400" to seconds since the epoch.
+
+static bool parse_log_date(const char* s, long& result)
+{
+  static const char* const months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  int day, year, hour, minute, second, zone;
+  char month[4];
+  if (sscanf(s, "%d/%3s/%d:%d:%d:%d %d", &day, month, &year, &hour, &minute, &second, &zone) != 7)
+    return false;
+  const char* m = strstr(months, month);
+  if (m == 0 || strlen(month) != 3)
+    return false;
+  int mon = (m - months) / 3 + 1;
+
+  // Days since 1970-01-01 of the proleptic Gregorian calendar.
+
+  int y = year - (mon <= 2);
+  long era = (y >= 0 ? y : y - 399) / 400;
+  long yoe = y - era * 400;
+  long doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  long days = era * 146097 + doe - 719468;
+
+  long offset = (zone / 100) * 3600 + (zone % 100) * 60;
+  result = days * 86400 + hour * 3600 + minute * 60 + second - offset;
+  return true;
+}
+
+// Parse a line of the form
+//
+//   PEER - - [DATE] "METHOD PATH HTTP/x.y" STATUS SIZE "REFERER" "AGENT"
+
+static bool parse_log_line(const string& line, const string& vhost, log_entry& e)
+{
+  string::size_type sp = line.find(' ');
+  string::size_type lb = line.find('[');
+  string::size_type rb = line.find(']', lb);
+  string::size_type q1 = line.find('"', rb);
+  if (sp == string::npos || lb == string::npos || rb == string::npos || q1 == string::npos)
+    return false;
+  string::size_type q2 = q1 + 1;
+  while (q2 < line.size() && line[q2] != '"')
+    q2 += (line[q2] == '\\') ? 2 : 1;
+  if (q2 >= line.size())
+    return false;
+
+  e.peer  = line.substr(0, sp);
+  e.vhost = vhost;
+  if (!parse_log_date(line.c_str() + lb + 1, e.time))
+    return false;
+
+  string request = line.substr(q1 + 1, q2 - q1 - 1);
+  string::size_type m_end = request.find(' ');
+  string::size_type p_end = request.rfind(' ');
+  if (m_end == string::npos || p_end == m_end)
+    return false;
+  e.method = request.substr(0, m_end);
+  e.path   = request.substr(m_end + 1, p_end - m_end - 1);
+  if (e.path.empty() || e.path[0] != '/')
+    return false;
+
+  char size[32];
+  if (sscanf(line.c_str() + q2 + 1, "%u %31s", &e.status, size) != 2)
+    return false;
+  e.size = (size[0] == '-') ? 0 : strtoul(size, 0, 10);
+  return true;
+}
+
+static void read_log(const char* filename)
+{
+  string vhost = filename;
+  string::size_type slash = vhost.rfind('/');
+  if (slash != string::npos)
+    vhost.erase(0, slash + 1);
+  if (vhost.size() <= 7 || vhost.compare(vhost.size() - 7, 7, "-access") != 0)
+    throw invalid_argument(string("cannot tell the virtual host from the name of '") + filename + "'");
+  vhost.erase(vhost.size() - 7);
+
+  FILE* fh = fopen(filename, "r");
+  if (fh == 0)
+    throw system_error(string("cannot open '") + filename + "'");
+  char buf[16 * 1024];
+  unsigned long line_no = 0, skipped = 0;
+  while (fgets(buf, sizeof(buf), fh) != 0)
+  {
+    ++line_no;
+    string line = buf;
+    if (!line.empty() && line[line.size() - 1] == '\n')
+      line.erase(line.size() - 1);
+    log_entry e;
+    e.order = entries.size();
+    if (parse_log_line(line, vhost, e) && (e.method == "GET" || e.method == "HEAD"))
+      entries.push_back(e);
+    else
+      ++skipped;
+  }
+  fclose(fh);
+  if (skipped)
+    fprintf(stderr, "bench-replay: skipped %lu of %lu lines in '%s'\n", skipped, line_no, filename);
+}
+
+// Create the files of the document root.
+
+static void make_directories(const string& path)
+{
+  for (string::size_type i = 1; i < path.size(); ++i)
+    if (path[i] == '/')
+      if (mkdir(path.substr(0, i).c_str(), 0755) == -1 && errno != EEXIST)
+        throw system_error("cannot create directory '" + path.substr(0, i) + "'");
+}
+
+static void synthesize()
+{
+  map<string, unsigned long> files;
+  for (vector<log_entry>::const_iterator e = entries.begin(); e != entries.end(); ++e)
+  {
+    if (e->status != 200 && e->status != 206 && e->status != 304)
+      continue;
+    string path = urldecode(e->path.substr(0, e->path.find('?')));
+    if (path.find("/../") != string::npos || path.find("/./") != string::npos)
+      continue;
+    if (path[path.size() - 1] == '/')
+      path += "index.html";
+    unsigned long& size = files[e->vhost + path];
+    size = max(size, e->size);
+  }
+
+  char block[64 * 1024];
+  for (size_t i = 0; i < sizeof(block); ++i)
+    block[i] = "abcdefghijklmnopqrstuvwxyz0123456789 \n"[i % 38];
+  for (map<string, unsigned long>::const_iterator f = files.begin(); f != files.end(); ++f)
+  {
+    string filename = synthesize_dir + "/" + f->first;
+    make_directories(filename);
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+      throw system_error("cannot create '" + filename + "'");
+    for (unsigned long left = f->second; left > 0; )
+    {
+      size_t len = min(left, static_cast<unsigned long>(sizeof(block)));
+      if (write(fd, block, len) != static_cast<ssize_t>(len))
+        throw system_error("cannot write '" + filename + "'");
+      left -= len;
+    }
+    close(fd);
+  }
+  printf("created %lu files in '%s'\n", static_cast<unsigned long>(files.size()), synthesize_dir.c_str());
+}
+
+// The replay. Every peer of the log is a session with a queue of
+// requests; an active session has a connection.
+
+struct session
+{
+  deque<const log_entry*> queue;
+  int                     fd;
+  long                    last_time;       // log time of the previous request
+  const log_entry*        outstanding;
+  uint64_t                sent_at;
+  string                  output;
+  string                  input;
+};
+
+static vector<uint64_t> latencies;
+static unsigned long    completed;
+static unsigned long    mismatches;
+static unsigned long    connects;
+static uint64_t         lateness;
+
+static int open_connection()
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    throw system_error("socket() failed");
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port   = htons(port);
+  if (inet_pton(AF_INET, host.c_str(), &sin.sin_addr) != 1)
+    throw invalid_argument("cannot parse host address '" + host + "'");
+  if (connect(fd, reinterpret_cast<sockaddr*>(&sin), sizeof(sin)) == -1)
+    throw system_error("cannot connect to " + host);
+  int true_flag = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &true_flag, sizeof(int));
+  if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+    throw system_error("cannot set non-blocking mode");
+  ++connects;
+  return fd;
+}
+
+static void close_connection(session& s)
+{
+  if (s.fd != -1)
+    close(s.fd);
+  s.fd = -1;
+  s.input.clear();
+  s.output.clear();
+}
+
+static void send_request(session& s, const log_entry& e)
+{
+  if (s.fd != -1 && e.time - s.last_time > keep_alive_gap)
+    close_connection(s);
+  if (s.fd == -1)
+    s.fd = open_connection();
+  s.output = e.method + " " + e.path + " HTTP/1.1\r\nHost: " + e.vhost + "\r\n";
+  if (e.status == 304)
+    s.output += "If-None-Match: *\r\n";
+  else if (e.status == 206 && e.size > 0)
+  {
+    char range[64];
+    snprintf(range, sizeof(range), "Range: bytes=0-%lu\r\n", e.size - 1);
+    s.output += range;
+  }
+  s.output     += "\r\n";
+  s.outstanding = &e;
+  s.last_time   = e.time;
+  s.sent_at     = monotonic_usec();
+}
+
+// Returns true once the reply to the outstanding request is complete.
+
+static bool parse_reply(session& s)
+{
+  string::size_type header_end = s.input.find("\r\n\r\n");
+  if (header_end == string::npos)
+    return false;
+  if (s.input.compare(0, 9, "HTTP/1.1 ") != 0)
+    throw runtime_error("received a malformed reply");
+  unsigned int status = atoi(s.input.c_str() + 9);
+  unsigned long length = 0;
+  string::size_type pos = s.input.find("\r\nContent-Length: ");
+  if (pos != string::npos && pos < header_end)
+    length = strtoul(s.input.c_str() + pos + 18, 0, 10);
+  if (status == 304 || s.outstanding->method == "HEAD")
+    length = 0;
+  if (s.input.size() < header_end + 4 + length)
+    return false;
+  s.input.erase(0, header_end + 4 + length);
+
+  if (status != s.outstanding->status)
+    ++mismatches;
+  if (status >= 400)
+    close_connection(s);
+  ++completed;
+  latencies.push_back(monotonic_usec() - s.sent_at);
+  s.outstanding = 0;
+  return true;
+}
+
+static void replay()
+{
+  map<string, session> sessions;
+  for (vector<log_entry>::const_iterator e = entries.begin(); e != entries.end(); ++e)
+  {
+    session& s = sessions[e->vhost + " " + e->peer];
+    if (s.queue.empty())
+    {
+      s.fd          = -1;
+      s.last_time   = e->time;
+      s.outstanding = 0;
+    }
+    s.queue.push_back(&*e);
+  }
+
+  // The sessions that are sending, and the ones that wait for their
+  // next request to become due or for a free connection.
+
+  vector<session*> active;
+  deque<session*>  waiting;
+  for (map<string, session>::iterator i = sessions.begin(); i != sessions.end(); ++i)
+    waiting.push_back(&i->second);
+
+  long     log_start = entries.front().time;
+  uint64_t start     = monotonic_usec();
+  vector<pollfd> pfds;
+
+  while (!active.empty() || !waiting.empty())
+  {
+    // Start requests that are due, as long as we have connections.
+
+    uint64_t now = monotonic_usec();
+    uint64_t next_due = 0;
+    for (deque<session*>::iterator i = waiting.begin(); i != waiting.end() && active.size() < max_connections; )
+    {
+      const log_entry& e = *(*i)->queue.front();
+      uint64_t due = start;
+      if (speed > 0.0)
+        due += static_cast<uint64_t>((e.time - log_start) * 1000000 / speed);
+      if (due <= now)
+      {
+        lateness += now - due;
+        (*i)->queue.pop_front();
+        send_request(**i, e);
+        active.push_back(*i);
+        i = waiting.erase(i);
+      }
+      else
+      {
+        if (next_due == 0 || due < next_due)
+          next_due = due;
+        ++i;
+      }
+    }
+
+    pfds.resize(active.size());
+    for (size_t i = 0; i < active.size(); ++i)
+    {
+      pfds[i].fd     = active[i]->fd;
+      pfds[i].events = POLLIN | (active[i]->output.empty() ? 0 : POLLOUT);
+    }
+    int timeout = 10000;
+    if (next_due != 0)
+      timeout = static_cast<int>((next_due - now) / 1000) + 1;
+    int rc = poll(pfds.empty() ? 0 : &pfds[0], pfds.size(), timeout);
+    if (rc < 0 && errno != EINTR)
+      throw system_error("poll() failed");
+    if (rc == 0 && next_due == 0)
+      throw runtime_error("the server did not answer within 10 seconds");
+
+    char buf[64 * 1024];
+    for (size_t i = 0; i < active.size(); ++i)
+    {
+      session& s = *active[i];
+      if (pfds[i].revents & POLLOUT)
+      {
+        ssize_t len = write(s.fd, s.output.data(), s.output.size());
+        if (len > 0)
+          s.output.erase(0, len);
+        else if (len == -1 && errno != EAGAIN && errno != EINTR)
+          throw system_error("write() failed");
+      }
+      if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+        continue;
+      ssize_t len = read(s.fd, buf, sizeof(buf));
+      if (len == -1 && (errno == EAGAIN || errno == EINTR))
+        continue;
+      bool closed = (len <= 0);
+      if (len > 0)
+        s.input.append(buf, len);
+      if (parse_reply(s) || closed)
+      {
+        // parse_reply() has closed the connection after an error
+        // reply, as the server does; we close it, too, once the
+        // session has no more requests.
+
+        if (closed || s.queue.empty())
+          close_connection(s);
+        if (closed && s.outstanding)
+          throw runtime_error("the server closed the connection before the reply was complete");
+        if (!s.queue.empty())
+          waiting.push_back(&s);
+        active[i] = 0;
+      }
+    }
+    active.erase(remove(active.begin(), active.end(), static_cast<session*>(0)), active.end());
+  }
+
+  double seconds = (monotonic_usec() - start) / 1e6;
+  sort(latencies.begin(), latencies.end());
+  size_t n = latencies.size();
+  printf("requests:         %lu in %.3f s, %lu connections\n", completed, seconds, connects);
+  printf("throughput:       %.0f requests/s\n", completed / seconds);
+  printf("status mismatch:  %lu\n", mismatches);
+  printf("latency (usec):   p50 %lu, p99 %lu, p999 %lu, max %lu\n",
+         static_cast<unsigned long>(latencies[n / 2]),
+         static_cast<unsigned long>(latencies[(n - 1) * 99 / 100]),
+         static_cast<unsigned long>(latencies[(n - 1) * 999 / 1000]),
+         static_cast<unsigned long>(latencies[n - 1]));
+  if (speed > 0.0)
+    printf("mean lateness:    %.0f usec behind the log's schedule\n", static_cast<double>(lateness) / n);
+}
+
+int main(int argc, char** argv)
+try
+{
+  const option longopts[] =
+  {
+    { "help",        no_argument,       0, 'h' },
+    { "host",        required_argument, 0, 'a' },
+    { "port",        required_argument, 0, 'p' },
+    { "connections", required_argument, 0, 'c' },
+    { "speed",       required_argument, 0, 's' },
+    { "keep-alive",  required_argument, 0, 'k' },
+    { "synthesize",  required_argument, 0, 'S' },
+    { 0, 0, 0, 0 }
+  };
+  int rc;
+  while ((rc = getopt_long(argc, argv, "hp:c:s:k:", longopts, 0)) != -1)
+  {
+    switch (rc)
+    {
+      case 'a': host            = optarg;                 break;
+      case 'p': port            = strtoul(optarg, 0, 10); break;
+      case 'c': max_connections = strtoul(optarg, 0, 10); break;
+      case 's': speed           = strtod(optarg, 0);      break;
+      case 'k': keep_alive_gap  = strtol(optarg, 0, 10);  break;
+      case 'S': synthesize_dir  = optarg;                 break;
+      case 'h':
+        fprintf(stderr, USAGE_MSG);
+        return 0;
+      default:
+        fprintf(stderr, USAGE_MSG);
+        return 1;
+    }
+  }
+  if (optind == argc)
+  {
+    fprintf(stderr, USAGE_MSG);
+    return 1;
+  }
+  if (max_connections == 0)
+    throw invalid_argument("--connections must be at least 1");
+
+  for (int i = optind; i < argc; ++i)
+    read_log(argv[i]);
+  if (entries.empty())
+    throw runtime_error("the logs contain no requests to replay");
+  stable_sort(entries.begin(), entries.end());
+  signal(SIGPIPE, SIG_IGN);
+
+  if (synthesize_dir.empty())
+    replay();
+  else
+    synthesize();
+  return 0;
+}
+catch (const exception& e)
+{
+  fprintf(stderr, "bench-replay: %s\n", e.what());
+  return 1;
+}
@@ -0,0 +1,63 @@
+#! /bin/sh
+#
+# Run the mini-httpd benchmark suite
+#
+# Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+#
+# This program is free software: you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation, either version 3 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program. If not, see <http://www.gnu.org/licenses/>.
+#
+# Starts ./httpd on a loopback port with a scratch document root and runs
+# bench-loadgen against it in a few configurations. Set BENCH_PORT,
+# BENCH_REQUESTS, or BENCH_CONNECTIONS to change the defaults; further
+# arguments are passed to every bench-loadgen run.
+
+set -eu
+
+port=${BENCH_PORT:-18080}
+requests=${BENCH_REQUESTS:-100000}
+connections=${BENCH_CONNECTIONS:-32}
+
+tmpdir=$(mktemp -d "${TMPDIR:-/tmp}/httpd-bench.XXXXXX")
+pid=
+cleanup()
+{
+  if [ -n "$pid" ]; then
+    kill "$pid" 2>/dev/null || true
+    wait "$pid" 2>/dev/null || true
+  fi
+  rm -rf "$tmpdir"
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p "$tmpdir/htdocs/localhost" "$tmpdir/logs"
+head -c 1024 /dev/zero | tr '\0' 'x' >"$tmpdir/htdocs/localhost/small.html"
+head -c 1048576 /dev/zero >"$tmpdir/htdocs/localhost/large.bin"
+
+./httpd -D -r "" --document-root "$tmpdir/htdocs" -l "$tmpdir/logs" -p "$port" &
+pid=$!
+sleep 1
+
+run()
+{
+  echo "== $1"
+  shift
+  ./bench-loadgen --port "$port" --server-pid "$pid" --requests "$requests" "$@"
+  echo
+}
+
+run "keep-alive, small files only" --connections "$connections" --mix 100,0,0,0 "$@"
+run "keep-alive, mixed requests" --connections "$connections" "$@"
+run "pipelined (depth 8), small files only" --connections "$connections" --pipeline 8 --mix 100,0,0,0 "$@"
+run "pipelined (depth 8), 304 replies only" --connections "$connections" --pipeline 8 --mix 0,0,0,100 "$@"
+run "single connection, large files only" --connections 1 --mix 0,100,0,0 --requests 2000 "$@"
@@ -17,8 +17,12 @@
 
 #include <config.h>
 
+#include <cerrno>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
+#include <cctype>
+#include <limits>
 #include <stdexcept>
 #include <getopt.h>
 #include "log.hh"
@@ -33,35 +37,90 @@ using namespace std;
 // Timeouts.
 unsigned int configuration::network_read_timeout         = 30 sec;
 unsigned int configuration::network_write_timeout        = 30 sec;
+unsigned int configuration::first_byte_timeout           =  0;
+unsigned int configuration::header_timeout               = 30 sec;
+unsigned int configuration::min_send_rate                =  0;
+unsigned int configuration::drain_timeout                = 30 sec;
 
 unsigned int configuration::hard_poll_interval_threshold = 32;
 int configuration::hard_poll_interval                    = 60 sec;
 
 // Buffer sizes.
 unsigned int configuration::max_line_length              =  4 kb;
+unsigned int configuration::max_header_size              = 16 kb;
+unsigned int configuration::max_header_count             = 100;
+unsigned int configuration::variant_cache_size           =  8 mb;
+unsigned int configuration::max_pipeline_batch           = 64 kb;
+unsigned int configuration::small_file_threshold         =  8 kb;
+off_t        configuration::drop_behind_threshold        =  0;
+unsigned int configuration::write_quantum                = 256 kb;
 
 // Paths.
 string configuration::chroot_directory                   = PREFIX;
 string configuration::logfile_directory                  = "/logs";
 string configuration::document_root                      = "/htdocs";
 string configuration::default_page                       = "index.html";
+string configuration::status_url;
+string configuration::status_host;
+string configuration::pack_file;
+string configuration::warm_manifest;
+string configuration::listen_unix;
+
+// Logging.
+string configuration::log_format = "%h - - %t \"%m %U %H\" %>s %b \"%{Referer}i\" \"%{User-Agent}i\"";
 
 // Run-time stuff.
 string configuration::server_string                      = PACKAGE_NAME;
 string configuration::default_hostname;
 char const * configuration::default_content_type         = "application/octet-stream";
 long int configuration::http_port                        = 80;
+int configuration::defer_accept                          = 0;
+int configuration::fastopen                              = 0;
+int configuration::listen_fd                             = -1;
+unsigned int configuration::slow_request_threshold       = 0;
+unsigned int configuration::rate_limit                   = 0;
+unsigned int configuration::max_connections_per_ip       = 0;
+unsigned int configuration::request_rate_per_ip          = 0;
 resetable_variable<uid_t> configuration::setuid_user;
 resetable_variable<gid_t> configuration::setgid_group;
 bool configuration::debugging                            = false;
 bool configuration::detach                               = true;
+bool configuration::precompressed                        = false;
+bool configuration::compress                             = false;
+bool configuration::use_mmap                             = false;
 
 #define USAGE_MSG \
   "Usage: httpd [-h | --help] [--version] [-d | --debug]\n" \
   "    [-p number | --port number] [-r path | --change-root path]\n" \
   "    [--document-root path] [-l path | --logfile-directory path]\n" \
   "    [-s string | --server-string string] [-u uid | --uid uid]\n" \
-  "    [-g gid | --gid gid] [--default-page filename]\n"
+  "    [-g gid | --gid gid] [--default-page filename]\n" \
+  "    [--precompressed] [--compress] [--variant-cache-size bytes]\n" \
+  "    [--defer-accept seconds] [--fastopen queue-length]\n" \
+  "    [--status-url path] [--slow-request-threshold msec]\n" \
+  "    [--log-format format] [--small-file-threshold bytes]\n" \
+  "    [--pack-file path] [--warm-manifest path] [--mmap]\n" \
+  "    [--drop-behind-threshold bytes] [--write-quantum bytes]\n" \
+  "    [--rate-limit bytes-per-second] [--max-connections-per-ip number]\n" \
+  "    [--request-rate-per-ip requests-per-second]\n" \
+  "    [--first-byte-timeout seconds] [--header-timeout seconds]\n" \
+  "    [--min-send-rate bytes-per-second] [--max-header-size bytes]\n" \
+  "    [--max-header-count number] [--drain-timeout seconds]\n" \
+  "    [--listen-fd number] [--listen-unix path]\n" \
+  "    [--status-host hostname]\n"
+
+// Parse the byte count given for an option. Values that don't fit are
+// an error rather than silently wrapped around.
+
+static unsigned long long parse_size(const char* option, const char* arg, unsigned long long max)
+{
+  char* end;
+  errno = 0;
+  unsigned long long size = strtoull(arg, &end, 10);
+  if (end == arg || *end != '\0' || arg[0] == '-' || errno == ERANGE || size > max)
+    throw runtime_error(string("specified --") + option + " is out of range");
+  return size;
+}
 
 configuration::configuration(int argc, char** argv)
 {
@@ -85,6 +144,32 @@ configuration::configuration(int argc, char** argv)
     { "default-hostname",   required_argument, 0, 'H' },
     { "document-root",      required_argument, 0, 'y' },
     { "default-page",       required_argument, 0, 'z' },
+    { "precompressed",      no_argument,       0, 'P' },
+    { "compress",           no_argument,       0, 'Z' },
+    { "variant-cache-size", required_argument, 0, 'V' },
+    { "defer-accept",       required_argument, 0, 'A' },
+    { "fastopen",           required_argument, 0, 'F' },
+    { "status-url",         required_argument, 0, 'S' },
+    { "slow-request-threshold", required_argument, 0, 'T' },
+    { "log-format",         required_argument, 0, 'f' },
+    { "small-file-threshold", required_argument, 0, 'W' },
+    { "pack-file",          required_argument, 0, 'K' },
+    { "warm-manifest",      required_argument, 0, 'M' },
+    { "mmap",               no_argument,       0, 'm' },
+    { "drop-behind-threshold", required_argument, 0, 'B' },
+    { "write-quantum",      required_argument, 0, 'Q' },
+    { "rate-limit",         required_argument, 0, 'R' },
+    { "max-connections-per-ip", required_argument, 0, 'c' },
+    { "request-rate-per-ip", required_argument, 0, 'q' },
+    { "first-byte-timeout", required_argument, 0, 'b' },
+    { "header-timeout",     required_argument, 0, 'e' },
+    { "min-send-rate",      required_argument, 0, 'n' },
+    { "max-header-size",    required_argument, 0, 'E' },
+    { "max-header-count",   required_argument, 0, 'N' },
+    { "drain-timeout",      required_argument, 0, 'G' },
+    { "listen-fd",          required_argument, 0, 'L' },
+    { "listen-unix",        required_argument, 0, 'U' },
+    { "status-host",        required_argument, 0, 'o' },
     { 0, 0, 0, 0 }          // mark end of array
   };
   int rc;
@@ -134,6 +219,98 @@ configuration::configuration(int argc, char** argv)
       case 'H':
         default_hostname = optarg;
         break;
+      case 'P':
+        precompressed = true;
+        break;
+      case 'Z':
+#ifdef HAVE_LIBZ
+        compress = true;
+        break;
+#else
+        throw runtime_error("this binary has been built without zlib; --compress is not available");
+#endif
+      case 'V':
+        variant_cache_size = parse_size("variant-cache-size", optarg, UINT_MAX);
+        break;
+      case 'A':
+        defer_accept = strtol(optarg, 0, 10);
+        if (defer_accept < 0)
+          throw runtime_error("specified --defer-accept timeout is out of range");
+        break;
+      case 'F':
+        fastopen = strtol(optarg, 0, 10);
+        if (fastopen < 0)
+          throw runtime_error("specified --fastopen queue length is out of range");
+        break;
+      case 'S':
+        status_url = optarg;
+        if (status_url.empty() || status_url[0] != '/')
+          throw invalid_argument("The --status-url must be an absolute path.");
+        break;
+      case 'T':
+        slow_request_threshold = strtoul(optarg, 0, 10);
+        break;
+      case 'f':
+        log_format = optarg;
+        break;
+      case 'W':
+        small_file_threshold = parse_size("small-file-threshold", optarg, UINT_MAX);
+        break;
+      case 'K':
+        pack_file = optarg;
+        break;
+      case 'M':
+        warm_manifest = optarg;
+        break;
+      case 'm':
+        use_mmap = true;
+        break;
+      case 'B':
+        drop_behind_threshold = parse_size("drop-behind-threshold", optarg, numeric_limits<off_t>::max());
+        break;
+      case 'Q':
+        write_quantum = parse_size("write-quantum", optarg, UINT_MAX);
+        break;
+      case 'R':
+        rate_limit = strtoul(optarg, 0, 10);
+        break;
+      case 'c':
+        max_connections_per_ip = strtoul(optarg, 0, 10);
+        break;
+      case 'q':
+        request_rate_per_ip = strtoul(optarg, 0, 10);
+        break;
+      case 'b':
+        first_byte_timeout = strtoul(optarg, 0, 10);
+        break;
+      case 'e':
+        header_timeout = strtoul(optarg, 0, 10);
+        break;
+      case 'n':
+        min_send_rate = strtoul(optarg, 0, 10);
+        break;
+      case 'E':
+        max_header_size = parse_size("max-header-size", optarg, UINT_MAX);
+        break;
+      case 'N':
+        max_header_count = strtoul(optarg, 0, 10);
+        break;
+      case 'G':
+        drain_timeout = strtoul(optarg, 0, 10);
+        break;
+      case 'L':
+        listen_fd = strtol(optarg, 0, 10);
+        if (listen_fd < 0)
+          throw runtime_error("specified --listen-fd is out of range");
+        break;
+      case 'U':
+        listen_unix = optarg;
+        break;
+      case 'o':
+        status_host = optarg;
+        for (string::iterator i = status_host.begin(); i != status_host.end(); ++i)
+          *i = tolower(*i);
+        break;
       default:
         fprintf(stderr, USAGE_MSG);
         throw runtime_error("incorrect command line syntax");
@@ -147,6 +324,12 @@ configuration::configuration(int argc, char** argv)
       throw invalid_argument("Setting an empty --document-root is not allowed.");
     if (logfile_directory.empty())
       throw invalid_argument("Setting an empty --document-root is not allowed.");
+    if (!pack_file.empty() && !warm_manifest.empty())
+      throw invalid_argument("A --pack-file is always warm; --warm-manifest doesn't go with it.");
+    if (rate_limit > 0 && min_send_rate > rate_limit)
+      throw invalid_argument("The --min-send-rate must not exceed the --rate-limit.");
+    if (listen_fd >= 0 && !listen_unix.empty())
+      throw invalid_argument("Either use --listen-fd or --listen-unix, not both.");
   }
 
   // Initialize the content type lookup map.
@@ -274,6 +457,24 @@ configuration::~configuration()
   TRACE();
 }
 
+bool configuration::is_compressible(const char* content_type) const
+{
+  static const char* const compressible_types[] =
+  {
+    "application/x-javascript", "application/postscript", "application/rtf",
+    "application/x-sh", "application/x-csh", "application/x-tcl",
+    "application/x-tex", "application/x-latex", "application/x-texinfo",
+    "application/x-troff", "application/x-troff-man", "application/x-troff-me",
+    "application/x-troff-ms"
+  };
+  if (strncasecmp(content_type, "text/", 5) == 0)
+    return true;
+  for (size_t i = 0; i < sizeof(compressible_types) / sizeof(compressible_types[0]); ++i)
+    if (strcasecmp(content_type, compressible_types[i]) == 0)
+      return true;
+  return false;
+}
+
 const char* configuration::get_content_type(const char* filename) const
 {
   const char* last_dot;
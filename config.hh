@@ -34,31 +34,63 @@ public:
   // Timeouts.
   static unsigned int network_read_timeout;
   static unsigned int network_write_timeout;
+  static unsigned int first_byte_timeout;
+  static unsigned int header_timeout;
+  static unsigned int min_send_rate;
+  static unsigned int drain_timeout;
   static unsigned int hard_poll_interval_threshold;
   static int          hard_poll_interval;
 
   // Buffer sizes.
   static unsigned int max_line_length;
+  static unsigned int max_header_size;
+  static unsigned int max_header_count;
+  static unsigned int variant_cache_size;
+  static unsigned int max_pipeline_batch;
+  static unsigned int small_file_threshold;
+  static off_t        drop_behind_threshold;
+  static unsigned int write_quantum;
 
   // Paths.
   static std::string  chroot_directory;
   static std::string  logfile_directory;
   static std::string  document_root;
   static std::string  default_page;
+  static std::string  status_url;
+  static std::string  status_host;
+  static std::string  pack_file;
+  static std::string  warm_manifest;
+  static std::string  listen_unix;
+
+  // Logging.
+  static std::string  log_format;
 
   // Run-time stuff.
   static char const *               default_content_type;
   static std::string                default_hostname;
   static long int                   http_port;
+  static int                        defer_accept;
+  static int                        fastopen;
+  static int                        listen_fd;
+  static unsigned int               slow_request_threshold;
+  static unsigned int               rate_limit;
+  static unsigned int               max_connections_per_ip;
+  static unsigned int               request_rate_per_ip;
   static std::string                server_string;
   static resetable_variable<uid_t>  setuid_user;
   static resetable_variable<gid_t>  setgid_group;
   static bool                       debugging;
   static bool                       detach;
+  static bool                       precompressed;
+  static bool                       compress;
+  static bool                       use_mmap;
 
   // Content-type mapping.
   const char* get_content_type(const char* filename) const;
 
+  // Is content of the given type worth compressing?
+  bool is_compressible(const char* content_type) const;
+
   // The error class throw in case version or usage information has
   // been requested and we're supposed to terminate.
   struct no_error { };
@@ -20,27 +20,29 @@
 
 #include <string>
 
+// Copy the input in one pass, replacing the characters that have a
+// special meaning in HTML by their entities.
+
 inline std::string escape_html_specials(const std::string& input)
 {
-  std::string tmp = input;
-  for (std::string::size_type pos = 0; pos <= tmp.size(); ++pos)
+  std::string tmp;
+  tmp.reserve(input.size() + 16);
+  std::string::size_type start = 0;
+  for (std::string::size_type pos = 0; pos < input.size(); ++pos)
   {
-    switch (tmp[pos])
+    const char* entity;
+    switch (input[pos])
     {
-      case '<':
-        tmp.replace(pos, 1, "&lt;");
-        pos += 3;
-        break;
-      case '>':
-        tmp.replace(pos, 1, "&gt;");
-        pos += 3;
-        break;
-      case '&':
-        tmp.replace(pos, 1, "&amp;");
-        pos += 4;
-        break;
+      case '<': entity = "&lt;";  break;
+      case '>': entity = "&gt;";  break;
+      case '&': entity = "&amp;"; break;
+      default:  continue;
     }
+    tmp.append(input, start, pos - start);
+    tmp.append(entity);
+    start = pos + 1;
   }
+  tmp.append(input, start, std::string::npos);
   return tmp;
 }
 
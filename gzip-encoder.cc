@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#ifdef HAVE_LIBZ
+
+#include <stdexcept>
+#include <zlib.h>
+#include "gzip-encoder.hh"
+
+using namespace std;
+
+gzip_encoder::gzip_encoder(int level) : stream(new z_stream)
+{
+  stream->zalloc = Z_NULL;
+  stream->zfree  = Z_NULL;
+  stream->opaque = Z_NULL;
+
+  // A window size of 15 plus 16 tells zlib to write a gzip header and
+  // trailer rather than the zlib ones.
+
+  if (deflateInit2(stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    delete stream;
+    throw runtime_error("cannot initialize zlib stream");
+  }
+}
+
+gzip_encoder::~gzip_encoder()
+{
+  deflateEnd(stream);
+  delete stream;
+}
+
+void gzip_encoder::encode(const char* input, size_t len, string& out, bool finish)
+{
+  stream->next_in  = reinterpret_cast<Bytef*>(const_cast<char*>(input));
+  stream->avail_in = len;
+
+  char buf[16384];
+  int rc;
+  do
+  {
+    stream->next_out  = reinterpret_cast<Bytef*>(buf);
+    stream->avail_out = sizeof(buf);
+    rc = deflate(stream, finish ? Z_FINISH : Z_NO_FLUSH);
+    if (rc == Z_STREAM_ERROR)
+      throw runtime_error("deflate() failed");
+    out.append(buf, sizeof(buf) - stream->avail_out);
+  }
+  while (stream->avail_out == 0 || (finish && rc != Z_STREAM_END));
+}
+
+#endif // HAVE_LIBZ
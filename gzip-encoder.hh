@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GZIP_ENCODER_HH_INCLUDED
+#define GZIP_ENCODER_HH_INCLUDED
+
+#include <string>
+#include <sys/types.h>
+
+struct z_stream_s;
+
+// Files smaller than this aren't worth compressing on the fly.
+
+const off_t min_compressible_size = 256;
+
+// This class wraps a zlib stream that produces gzip-formatted output.
+// Feed it the file contents piece by piece; the compressed data is
+// appended to the output string. Errors are reported via exceptions.
+//
+// The zlib stream is kept behind a pointer so that this header can be
+// included without zlib; the encoder can only be instantiated if
+// configure found the library, though.
+
+class gzip_encoder
+{
+public:
+  explicit gzip_encoder(int level = -1); // zlib's default level
+  ~gzip_encoder();
+
+  // Compress the given input and append whatever output zlib produces
+  // to out. Setting finish flushes the stream and writes the gzip
+  // trailer; the encoder cannot be used anymore afterwards.
+
+  void encode(const char* input, size_t len, std::string& out, bool finish = false);
+
+private:                      // Don't copy me.
+  gzip_encoder(const gzip_encoder&);
+  gzip_encoder& operator= (const gzip_encoder&);
+
+private:
+  z_stream_s* stream;
+};
+
+#endif // GZIP_ENCODER_HH_INCLUDED
@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   httpd-pack -- turn a document root into a pack file
+
+   The program reads a document root the way httpd serves it -- one
+   directory per virtual host -- and writes everything into a single
+   pack file (see pack-file.hh), which "httpd --pack-file" serves
+   without touching the file system. The file is written under a
+   temporary name and renamed into place when complete, so a running
+   deployment is replaced atomically.
+
+   Text documents are stored gzipped as well when zlib is available
+   and --no-gzip hasn't been given. The entity tags are derived from
+   the file contents, so they stay the same across packs as long as
+   the files do.
+*/
+
+#include <config.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "pack-file.hh"
+#include "gzip-encoder.hh"
+#include "timestamp-to-string.hh"
+#include "system-error.hh"
+#include "config.hh"
+
+using namespace std;
+
+const configuration* config;
+
+#define USAGE_MSG \
+  "Usage: httpd-pack [--default-page filename] [--no-gzip] document-root pack-file\n"
+
+static string default_page = "index.html";
+static bool   use_gzip     = true;
+
+struct pack_item
+{
+  string       key;             // "hostname/path"
+  string       filename;        // empty for directories
+  uint32_t     flags;
+  int64_t      mtime;
+  string       alias_of;        // key of the entry whose data we share
+};
+
+static vector<pack_item> items;
+
+// Symbolic links are followed like the server follows them, except for
+// links to a directory we're in already, which would have us recurse
+// forever. Directories are identified by device and inode number.
+
+typedef set< pair<dev_t, ino_t> > dir_set;
+
+static void walk(const string& dir, const string& key_prefix, dir_set& ancestors)
+{
+  DIR* d = opendir(dir.c_str());
+  if (d == 0)
+    throw system_error("cannot read directory '" + dir + "'");
+  vector<string> names;
+  for (dirent* de; (de = readdir(d)) != 0; )
+    if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+      names.push_back(de->d_name);
+  closedir(d);
+  sort(names.begin(), names.end());
+
+  for (vector<string>::const_iterator i = names.begin(); i != names.end(); ++i)
+  {
+    string path = dir + "/" + *i;
+    string key  = key_prefix + "/" + *i;
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1)
+      throw system_error("cannot stat '" + path + "'");
+
+    pack_item item;
+    item.key   = key;
+    item.mtime = st.st_mtime;
+    if (S_ISDIR(st.st_mode))
+    {
+      pair<dev_t, ino_t> id(st.st_dev, st.st_ino);
+      if (!ancestors.insert(id).second)
+      {
+        fprintf(stderr, "httpd-pack: skipping '%s', which leads back to a parent directory\n", path.c_str());
+        continue;
+      }
+      item.flags = PACK_DIRECTORY;
+      items.push_back(item);
+      walk(path, key, ancestors);
+      ancestors.erase(id);
+      if (access((path + "/" + default_page).c_str(), R_OK) == 0)
+      {
+        item.key      = key + "/";
+        item.flags    = 0;
+        item.alias_of = key + "/" + default_page;
+        items.push_back(item);
+      }
+    }
+    else if (S_ISREG(st.st_mode))
+    {
+      item.filename = path;
+      item.flags    = 0;
+      items.push_back(item);
+    }
+  }
+}
+
+static string read_file(const string& filename)
+{
+  FILE* fh = fopen(filename.c_str(), "rb");
+  if (fh == 0)
+    throw system_error("cannot open '" + filename + "'");
+  string contents;
+  char buf[64 * 1024];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), fh)) > 0)
+    contents.append(buf, len);
+  bool failed = ferror(fh);
+  fclose(fh);
+  if (failed)
+    throw system_error("cannot read '" + filename + "'");
+  return contents;
+}
+
+static string content_hash(const string& data)
+{
+  uint64_t h = 14695981039346656037ull;
+  for (string::const_iterator i = data.begin(); i != data.end(); ++i)
+  {
+    h ^= static_cast<unsigned char>(*i);
+    h *= 1099511628211ull;
+  }
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%016llx-%lx", static_cast<unsigned long long>(h),
+           static_cast<unsigned long>(data.size()));
+  return buf;
+}
+
+// The output file, written sequentially.
+
+static FILE*    out;
+static string   out_name;
+static uint64_t out_pos;
+
+static void put(const void* data, size_t len)
+{
+  if (len > 0 && fwrite(data, 1, len, out) != len)
+    throw system_error("cannot write '" + out_name + "'");
+  out_pos += len;
+}
+
+static uint64_t put_string(const string& s)
+{
+  uint64_t offset = out_pos;
+  put(s.data(), s.size());
+  return offset;
+}
+
+static pack_variant put_variant(const string& body, const string& etag, const string& header)
+{
+  pack_variant v;
+  v.header_offset = put_string(header);
+  v.header_size   = header.size();
+  v.etag_offset   = put_string(etag);
+  v.etag_size     = etag.size();
+  v.body_offset   = put_string(body);
+  v.body_size     = body.size();
+  return v;
+}
+
+int main(int argc, char** argv)
+try
+{
+  const option longopts[] =
+  {
+    { "help",         no_argument,       0, 'h' },
+    { "default-page", required_argument, 0, 'z' },
+    { "no-gzip",      no_argument,       0, 'n' },
+    { 0, 0, 0, 0 }
+  };
+  int rc;
+  while ((rc = getopt_long(argc, argv, "h", longopts, 0)) != -1)
+  {
+    switch (rc)
+    {
+      case 'z': default_page = optarg; break;
+      case 'n': use_gzip     = false;  break;
+      case 'h':
+        fprintf(stderr, USAGE_MSG);
+        return 0;
+      default:
+        fprintf(stderr, USAGE_MSG);
+        return 1;
+    }
+  }
+  if (argc - optind != 2)
+  {
+    fprintf(stderr, USAGE_MSG);
+    return 1;
+  }
+  string document_root = argv[optind];
+  out_name             = argv[optind + 1];
+
+  char* config_argv[] = { argv[0], 0 };
+  configuration real_config(1, config_argv);
+  config = &real_config;
+
+  // Every directory in the document root is a virtual host. The
+  // server looks them up in lowercase.
+
+  DIR* d = opendir(document_root.c_str());
+  if (d == 0)
+    throw system_error("cannot read directory '" + document_root + "'");
+  vector<string> hosts;
+  for (dirent* de; (de = readdir(d)) != 0; )
+    if (de->d_name[0] != '.')
+      hosts.push_back(de->d_name);
+  closedir(d);
+  sort(hosts.begin(), hosts.end());
+  for (vector<string>::const_iterator i = hosts.begin(); i != hosts.end(); ++i)
+  {
+    struct stat st;
+    string dir = document_root + "/" + *i;
+    if (stat(dir.c_str(), &st) == -1 || !S_ISDIR(st.st_mode))
+      continue;
+    string host = *i;
+    for (string::iterator c = host.begin(); c != host.end(); ++c)
+      *c = tolower(*c);
+    if (access((dir + "/" + default_page).c_str(), R_OK) == 0)
+    {
+      pack_item item;
+      item.key      = host + "/";
+      item.flags    = 0;
+      item.mtime    = st.st_mtime;
+      item.alias_of = host + "/" + default_page;
+      items.push_back(item);
+    }
+    dir_set ancestors;
+    ancestors.insert(make_pair(st.st_dev, st.st_ino));
+    walk(dir, host, ancestors);
+  }
+  if (items.empty())
+    throw runtime_error("there is nothing to pack in '" + document_root + "'");
+
+  // Lay out the file: header, buckets, entries, then the data.
+
+  pack_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, pack_magic, sizeof(pack_magic));
+  header.version      = pack_version;
+  header.byteorder    = pack_byteorder;
+  header.entry_count  = items.size();
+  header.bucket_count = items.size() * 2 + 1;
+  size_t buckets_size = (header.bucket_count * sizeof(uint32_t) + 7) & ~static_cast<size_t>(7);
+  uint64_t data_start = sizeof(pack_header) + buckets_size + items.size() * sizeof(pack_entry);
+
+  string tmp_name = out_name + ".tmp";
+  out = fopen(tmp_name.c_str(), "wb");
+  if (out == 0)
+    throw system_error("cannot create '" + tmp_name + "'");
+  if (fseek(out, data_start, SEEK_SET) == -1)
+    throw system_error("cannot seek in '" + tmp_name + "'");
+  out_pos = data_start;
+
+  vector<pack_entry> entries(items.size());
+  map<string, size_t> index_of;
+  unsigned long gzipped = 0;
+  for (size_t i = 0; i < items.size(); ++i)
+  {
+    const pack_item& item = items[i];
+    pack_entry& e = entries[i];
+    memset(&e, 0, sizeof(e));
+    index_of[item.key] = i;
+    e.key_offset = put_string(item.key);
+    e.key_size   = item.key.size();
+    e.hash       = pack_hash(item.key.data(), item.key.size());
+    e.flags      = item.flags;
+    e.mtime      = item.mtime;
+    if (item.filename.empty())
+      continue;
+
+    string body         = read_file(item.filename);
+    const char* type    = config->get_content_type(item.filename.c_str());
+    string etag         = "\"p" + content_hash(body) + "\"";
+    string last_mod     = "Last-Modified: " + time_to_rfcdate(item.mtime) + "\r\n";
+    string compressed;
+#ifdef HAVE_LIBZ
+    if (use_gzip && config->is_compressible(type) && body.size() >= static_cast<size_t>(min_compressible_size))
+    {
+      gzip_encoder encoder(9);
+      encoder.encode(body.data(), body.size(), compressed, true);
+      if (compressed.size() >= body.size())
+        compressed.clear();
+    }
+#endif
+    string vary = compressed.empty() ? "" : "Vary: Accept-Encoding\r\n";
+    e.identity = put_variant(body, etag,
+                             string("Content-Type: ") + type + "\r\n" + vary + last_mod +
+                             "ETag: " + etag + "\r\n");
+    if (!compressed.empty())
+    {
+      string gzip_etag = etag.substr(0, etag.size() - 1) + "-gzip\"";
+      e.gzip = put_variant(compressed, gzip_etag,
+                           string("Content-Type: ") + type + "\r\n" +
+                           "Content-Encoding: gzip\r\n" + vary + last_mod +
+                           "ETag: " + gzip_etag + "\r\n");
+      ++gzipped;
+    }
+  }
+
+  // Directory index pages share the data of the page they stand for.
+
+  for (size_t i = 0; i < items.size(); ++i)
+  {
+    map<string, size_t>::const_iterator t = index_of.find(items[i].alias_of);
+    if (t == index_of.end())
+      continue;
+    const pack_entry& target = entries[t->second];
+    entries[i].identity = target.identity;
+    entries[i].gzip     = target.gzip;
+    entries[i].mtime    = target.mtime;
+  }
+
+  // Hash the entries into the buckets.
+
+  vector<uint32_t> buckets(buckets_size / sizeof(uint32_t), pack_none);
+  for (size_t i = entries.size(); i-- > 0; )
+  {
+    uint32_t& head = buckets[entries[i].hash % header.bucket_count];
+    entries[i].next = head;
+    head = i;
+  }
+
+  header.file_size = out_pos;
+  if (fseek(out, 0, SEEK_SET) == -1)
+    throw system_error("cannot seek in '" + tmp_name + "'");
+  put(&header, sizeof(header));
+  put(&buckets[0], buckets_size);
+  put(&entries[0], entries.size() * sizeof(pack_entry));
+  if (fclose(out) != 0)
+    throw system_error("cannot write '" + tmp_name + "'");
+  if (rename(tmp_name.c_str(), out_name.c_str()) == -1)
+    throw system_error("cannot rename '" + tmp_name + "' to '" + out_name + "'");
+
+  printf("packed %lu entries (%lu gzipped) into '%s', %llu bytes\n",
+         static_cast<unsigned long>(items.size()), gzipped, out_name.c_str(),
+         static_cast<unsigned long long>(header.file_size));
+  return 0;
+}
+catch (const exception& e)
+{
+  fprintf(stderr, "httpd-pack: %s\n", e.what());
+  return 1;
+}
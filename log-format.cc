@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdexcept>
+#include <cstdio>
+#include <strings.h>
+#include "log-format.hh"
+#include "timestamp-to-string.hh"
+
+using namespace std;
+
+log_format::log_format()
+{
+}
+
+void log_format::add_literal(const string& text)
+{
+  if (text.empty())
+    return;
+  if (!program.empty() && program.back().opcode == LITERAL)
+    program.back().literal += text;
+  else
+  {
+    operation op;
+    op.opcode  = LITERAL;
+    op.literal = text;
+    program.push_back(op);
+  }
+}
+
+void log_format::compile(const string& format)
+{
+  vector<operation> old_program;
+  old_program.swap(program);
+
+  try
+  {
+    for (string::size_type i = 0; i < format.size(); ++i)
+    {
+      if (format[i] != '%')
+      {
+        add_literal(string(1, format[i]));
+        continue;
+      }
+      string::size_type start = i;
+      if (++i == format.size())
+        throw invalid_argument("log format ends with an incomplete directive");
+
+      // Parse the optional argument in braces and the final-status
+      // modifier, which is all we ever report anyway.
+
+      string arg;
+      if (format[i] == '{')
+      {
+        string::size_type end = format.find('}', i);
+        if (end == string::npos)
+          throw invalid_argument("unterminated argument in log format directive '" + format.substr(start) + "'");
+        arg = format.substr(i + 1, end - i - 1);
+        i = end + 1;
+      }
+      if (i < format.size() && format[i] == '>')
+        ++i;
+      if (i == format.size())
+        throw invalid_argument("log format ends with an incomplete directive");
+
+      operation op;
+      op.opcode = LITERAL;
+      switch (format[i])
+      {
+        case '%': add_literal("%"); continue;
+        case 'l': add_literal("-"); continue;
+        case 'u': add_literal("-"); continue;
+        case 'h': op.opcode = PEER_ADDRESS;       break;
+        case 't': op.opcode = TIMESTAMP;          break;
+        case 'r': op.opcode = REQUEST_LINE;       break;
+        case 'm': op.opcode = METHOD;             break;
+        case 'U': op.opcode = PATH;               break;
+        case 'q': op.opcode = QUERY;              break;
+        case 'H': op.opcode = PROTOCOL;           break;
+        case 'v': op.opcode = HOST;               break;
+        case 's': op.opcode = STATUS;             break;
+        case 'b': op.opcode = SIZE_CLF;           break;
+        case 'B': op.opcode = SIZE;               break;
+        case 'O': op.opcode = BYTES_SENT;         break;
+        case 'D': op.opcode = REQUEST_TIME_USEC;  break;
+        case 'T': op.opcode = REQUEST_TIME_SEC;   break;
+        case 'k': op.opcode = KEEPALIVE_REQUESTS; break;
+        case 'X': op.opcode = CONNECTION_STATUS;  break;
+        case '^':
+          if (format.compare(i, 3, "^FB") == 0)
+          {
+            op.opcode = TIME_TO_FIRST_BYTE;
+            i += 2;
+          }
+          break;
+        case 'i':
+          if (strcasecmp(arg.c_str(), "Referer") == 0)
+            op.opcode = REFERER;
+          else if (strcasecmp(arg.c_str(), "User-Agent") == 0)
+            op.opcode = USER_AGENT;
+          else if (strcasecmp(arg.c_str(), "Host") == 0)
+            op.opcode = HOST_HEADER;
+          break;
+        case 'o':
+          if (strcasecmp(arg.c_str(), "Content-Encoding") == 0)
+            op.opcode = CONTENT_ENCODING;
+          else if (strcasecmp(arg.c_str(), "ETag") == 0)
+            op.opcode = ETAG;
+          break;
+        case 'n':
+          if (arg == "cache")
+            op.opcode = CACHE_STATUS;
+          break;
+      }
+      if (op.opcode == LITERAL)
+        throw invalid_argument("unsupported log format directive '" + format.substr(start, i + 1 - start) + "'");
+      program.push_back(op);
+    }
+  }
+  catch (...)
+  {
+    program.swap(old_program);
+    throw;
+  }
+}
+
+// Text that came from the peer is quoted so that it can't break the
+// log file's syntax.
+
+static void append_escaped(string& buf, const string& text)
+{
+  for (string::const_iterator i = text.begin(); i != text.end(); ++i)
+  {
+    if (*i == '"' || *i == '\\')
+      buf += '\\';
+    buf += *i;
+  }
+}
+
+static void append_string_or_dash(string& buf, const string& text)
+{
+  if (text.empty())
+    buf += '-';
+  else
+    append_escaped(buf, text);
+}
+
+static void append_number(string& buf, uint64_t n)
+{
+  char tmp[24];
+  char* p = tmp + sizeof(tmp);
+  do
+  {
+    *--p = '0' + n % 10;
+    n /= 10;
+  }
+  while (n != 0);
+  buf.append(p, tmp + sizeof(tmp));
+}
+
+void log_format::format(const log_record& rec, string& buf) const
+{
+  const HTTPRequest& req = *rec.request;
+  for (vector<operation>::const_iterator op = program.begin(); op != program.end(); ++op)
+  {
+    switch (op->opcode)
+    {
+      case LITERAL:
+        buf += op->literal;
+        break;
+      case PEER_ADDRESS:
+        buf += rec.peer_address;
+        break;
+      case TIMESTAMP:
+        buf += '[';
+        buf += time_to_logdate(req.start_up_time);
+        buf += ']';
+        break;
+      case REQUEST_LINE:
+        buf += req.method;
+        buf += ' ';
+        append_escaped(buf, req.url.path);
+        if (!req.url.query.empty())
+        {
+          buf += '?';
+          append_escaped(buf, req.url.query);
+        }
+        buf += ' ';
+        // fall through
+      case PROTOCOL:
+        buf += "HTTP/";
+        append_number(buf, req.major_version);
+        buf += '.';
+        append_number(buf, req.minor_version);
+        break;
+      case METHOD:
+        buf += req.method;
+        break;
+      case PATH:
+        append_escaped(buf, req.url.path);
+        break;
+      case QUERY:
+        if (!req.url.query.empty())
+        {
+          buf += '?';
+          append_escaped(buf, req.url.query);
+        }
+        break;
+      case HOST:
+        append_string_or_dash(buf, req.host);
+        break;
+      case STATUS:
+        append_number(buf, req.status_code.data());
+        break;
+      case SIZE_CLF:
+        if (req.object_size.empty())
+          buf += '-';
+        else
+          append_number(buf, req.object_size.data());
+        break;
+      case SIZE:
+        append_number(buf, req.object_size.empty() ? 0 : req.object_size.data());
+        break;
+      case BYTES_SENT:
+        append_number(buf, rec.bytes_sent);
+        break;
+      case REQUEST_TIME_USEC:
+        append_number(buf, rec.request_time);
+        break;
+      case REQUEST_TIME_SEC:
+        append_number(buf, rec.request_time / 1000000);
+        break;
+      case TIME_TO_FIRST_BYTE:
+        append_number(buf, rec.time_to_first_byte);
+        break;
+      case KEEPALIVE_REQUESTS:
+        append_number(buf, rec.keepalive_requests);
+        break;
+      case CONNECTION_STATUS:
+        buf += rec.aborted ? 'X' : (rec.persistent ? '+' : '-');
+        break;
+      case REFERER:
+        append_escaped(buf, req.referer);
+        break;
+      case USER_AGENT:
+        append_escaped(buf, req.user_agent);
+        break;
+      case HOST_HEADER:
+        append_escaped(buf, req.host);
+        break;
+      case CONTENT_ENCODING:
+        append_string_or_dash(buf, *rec.content_encoding);
+        break;
+      case ETAG:
+        append_string_or_dash(buf, *rec.etag);
+        break;
+      case CACHE_STATUS:
+        buf += rec.cache_status ? rec.cache_status : "-";
+        break;
+    }
+  }
+}
+
+// The global access log format.
+
+log_format access_log_format;
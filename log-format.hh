@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOG_FORMAT_HH_INCLUDED
+#define LOG_FORMAT_HH_INCLUDED
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "HTTPRequest.hh"
+
+// Everything an access log entry may refer to.
+
+struct log_record
+{
+  const char*        peer_address;
+  const HTTPRequest* request;
+  const std::string* content_encoding;
+  const std::string* etag;
+  const char*        cache_status;       // "HIT", "MISS", or 0
+  uint64_t           request_time;       // microseconds
+  uint64_t           time_to_first_byte; // microseconds
+  uint64_t           bytes_sent;
+  unsigned int       keepalive_requests; // earlier requests on the connection
+  bool               aborted;
+  bool               persistent;
+};
+
+// An access log format in the style of Apache's LogFormat directive.
+// The format string is compiled once into a list of operations, so
+// formatting an entry doesn't have to parse anything. The supported
+// directives are documented in httpd.txt.
+
+class log_format
+{
+public:
+  log_format();
+
+  // Replace the current format. Throws std::invalid_argument if the
+  // string contains a directive we don't know.
+
+  void compile(const std::string& format);
+
+  // Append the entry for the given request to the buffer, without the
+  // trailing newline.
+
+  void format(const log_record& rec, std::string& buf) const;
+
+private:
+  enum opcode_t
+  {
+    LITERAL, PEER_ADDRESS, TIMESTAMP, REQUEST_LINE, METHOD, PATH, QUERY,
+    PROTOCOL, HOST, STATUS, SIZE_CLF, SIZE, BYTES_SENT, REQUEST_TIME_USEC,
+    REQUEST_TIME_SEC, TIME_TO_FIRST_BYTE, KEEPALIVE_REQUESTS,
+    CONNECTION_STATUS, REFERER, USER_AGENT, HOST_HEADER, CONTENT_ENCODING,
+    ETAG, CACHE_STATUS
+  };
+
+  struct operation
+  {
+    opcode_t    opcode;
+    std::string literal;
+  };
+
+  void add_literal(const std::string& text);
+
+  std::vector<operation> program;
+};
+
+extern log_format access_log_format;
+
+#endif // LOG_FORMAT_HH_INCLUDED
@@ -19,12 +19,19 @@
 #include <signal.h>
 #include <stdexcept>
 #include <ctime>
+#include <cstdlib>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <boost/scoped_ptr.hpp>
 #include "tcp-listener.hh"
 #include "RequestHandler.hh"
+#include "variant-cache.hh"
+#include "log-format.hh"
+#include "pack-file.hh"
+#include "warmup.hh"
+#include "upgrade.hh"
 #include "log.hh"
 #include "config.hh"
 
@@ -32,12 +39,55 @@ using namespace std;
 
 const configuration* config;
 volatile sig_atomic_t got_terminate_sig = false;
+volatile sig_atomic_t got_upgrade_sig = false;
 
 static void set_sig_term(int)
 {
   got_terminate_sig = true;
 }
 
+static void set_sig_upgrade(int)
+{
+  got_upgrade_sig = true;
+}
+
+// Find the listening socket we may have inherited: from the server
+// we're replacing, from the command line, or from a service manager
+// that passes sockets the way systemd does. Returns -1 if there is
+// none, in which case we create a socket ourselves.
+
+static int inherited_listen_fd()
+{
+  if (const char* fd = getenv(LISTEN_FD_VARIABLE))
+  {
+    int listen_fd = atoi(fd);
+    unsetenv(LISTEN_FD_VARIABLE);
+    return listen_fd;
+  }
+  if (config->listen_fd >= 0)
+    return config->listen_fd;
+
+  // The service manager's sockets start at descriptor 3. They're meant
+  // for us only if LISTEN_PID is our process id.
+
+  const char* pid = getenv("LISTEN_PID");
+  const char* fds = getenv("LISTEN_FDS");
+  if (!pid || !fds || strtol(pid, 0, 10) != static_cast<long>(getpid()))
+    return -1;
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  int count = atoi(fds);
+  if (count <= 0)
+    return -1;
+  for (int fd = 4; fd < 3 + count; ++fd)
+  {
+    info("Ignoring socket %d passed by the service manager; we need only one.", fd);
+    close(fd);
+  }
+  return 3;
+}
+
 int main(int argc, char** argv)
 try
 {
@@ -45,6 +95,9 @@ try
 
   configuration real_config(argc, argv);
   config = &real_config;
+  compressed_variants.set_capacity(config->variant_cache_size);
+  peers.set_limits(config->max_connections_per_ip, config->request_rate_per_ip);
+  access_log_format.compile(config->log_format);
 
   // Install signal handler.
 
@@ -52,13 +105,54 @@ try
   signal(SIGINT, reinterpret_cast<sighandler_t>(&set_sig_term));
   signal(SIGHUP, reinterpret_cast<sighandler_t>(&set_sig_term));
   signal(SIGQUIT, reinterpret_cast<sighandler_t>(&set_sig_term));
+  signal(SIGUSR2, reinterpret_cast<sighandler_t>(&set_sig_upgrade));
   signal(SIGPIPE, SIG_IGN);
 
-  // Start-up scheduler and listener.
+  // Start-up scheduler and listener. If we have been handed a socket
+  // that's listening already, we use that one. A Unix domain socket is
+  // for the proxy in front of us, which should be in our group.
 
   bool using_accurate_poll_interval = true;
   scheduler sched;
-  TCPListener<RequestHandler> listener(sched, config->http_port);
+  boost::scoped_ptr< TCPListener<RequestHandler> > listener;
+  int listen_fd = inherited_listen_fd();
+  if (listen_fd >= 0)
+    listener.reset(new TCPListener<RequestHandler>(sched, listen_fd,
+                                                   config->defer_accept, config->fastopen));
+  else if (!config->listen_unix.empty())
+  {
+    listener.reset(new TCPListener<RequestHandler>(sched, config->listen_unix, 50));
+    if (geteuid() == 0)
+    {
+      uid_t uid = config->setuid_user.empty() ? static_cast<uid_t>(-1) : config->setuid_user.data();
+      gid_t gid = config->setgid_group.empty() ? static_cast<gid_t>(-1) : config->setgid_group.data();
+      if (chown(config->listen_unix.c_str(), uid, gid) == -1)
+        throw system_error("cannot change owner of '" + config->listen_unix + "'");
+    }
+    if (chmod(config->listen_unix.c_str(), 0660) == -1)
+      throw system_error("cannot change permissions of '" + config->listen_unix + "'");
+  }
+  else
+    listener.reset(new TCPListener<RequestHandler>(sched, config->http_port, 50,
+                                                   config->defer_accept, config->fastopen));
+  binary_upgrade upgrade(sched);
+  upgrade.set_command(argv);
+
+  // The new server of an upgrade must be run outside of our sandbox,
+  // by a process that keeps our privileges.
+
+  upgrade.start_helper(listener->fd());
+
+  // Map the document root snapshot while we can still reach it.
+
+  if (!config->pack_file.empty())
+    document_pack.open(config->pack_file);
+
+  // Open the list of files to warm the caches with while we can still
+  // write it.
+
+  if (!config->warm_manifest.empty())
+    warmer.open_manifest(config->warm_manifest);
 
   // Change root to our sandbox.
 
@@ -105,17 +199,86 @@ try
 
   // Log some helpful information.
 
-  info("%s %s starting up: listen port = %u, user id = %u, group id = %u, chroot = '%s', " \
+  info("%s %s starting up: listen address = '%s', user id = %u, group id = %u, chroot = '%s', " \
        "default hostname = '%s'", PACKAGE_NAME, PACKAGE_VERSION,
-       config->http_port, getuid(), getgid(), config->chroot_directory.c_str(),
+       listener->address().c_str(), getuid(), getgid(), config->chroot_directory.c_str(),
        config->default_hostname.c_str());
 
-  // Run ...
+  // Read the list of files to warm the caches with. The scheduler
+  // mustn't block in poll() until we're through with them.
 
+  if (!config->warm_manifest.empty())
+  {
+    warmer.load();
+    if (!warmer.done())
+    {
+      sched.set_poll_interval(0);
+      using_accurate_poll_interval = false;
+    }
+  }
+
+  // Run ... If a server has started us to take over, it can go now.
+
+  binary_upgrade::report_ready();
+  time_t drain_deadline = 0;
   while (!got_terminate_sig && !sched.empty())
   {
     sched.schedule();
 
+    // On SIGUSR2, a new instance of the server takes over. Once it's
+    // up, we close the idle connections, finish the requests we have,
+    // and exit when they're done -- or when the drain timeout has
+    // expired.
+
+    if (got_upgrade_sig)
+    {
+      got_upgrade_sig = false;
+      if (drain_deadline == 0)
+      {
+        try
+        {
+          upgrade.start();
+        }
+        catch (const exception& e)
+        {
+          error("Cannot start the new server: %s", e.what());
+        }
+      }
+    }
+    if (upgrade.status() == binary_upgrade::SUCCEEDED)
+    {
+      if (drain_deadline == 0)
+      {
+        listener->stop();
+        RequestHandler::draining = true;
+        unsigned int idle = RequestHandler::close_idle_connections();
+        if (idle > 0)
+          info("Closed %u idle connections.", idle);
+        drain_deadline = time(0) + config->drain_timeout;
+        sched.set_poll_interval(1000);
+        using_accurate_poll_interval = false;
+      }
+      else if (time(0) >= drain_deadline)
+      {
+        info("Drain timeout expired; closing %u connections.", RequestHandler::instances);
+        RequestHandler::close_all_connections();
+        break;
+      }
+      continue;
+    }
+
+    // Warm a few files -- or compress a chunk of one -- at a time, so
+    // that peers don't notice.
+
+    if (!warmer.done())
+    {
+      if (warmer.step())
+        continue;
+      info("Warmed the caches with %lu files.", static_cast<unsigned long>(warmer.warmed()));
+      sched.use_accurate_poll_interval();
+      using_accurate_poll_interval = true;
+    }
+
     if (RequestHandler::instances > config->hard_poll_interval_threshold)
     {
       if (using_accurate_poll_interval)
@@ -138,9 +301,12 @@ try
     }
   }
 
-  // Exit gracefully.
+  // Exit gracefully. The files we served are the ones to warm the
+  // caches with the next time.
 
   info("httpd shutting down.");
+  if (!config->warm_manifest.empty())
+    warmer.save();
   return 0;
 }
 catch (const configuration::no_error&)
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdexcept>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "system-error.hh"
+#include "pack-file.hh"
+
+using namespace std;
+
+pack_archive::pack_archive() : base(0), size(0), header(0), buckets(0), entries(0)
+{
+}
+
+pack_archive::~pack_archive()
+{
+  if (base != 0)
+    munmap(const_cast<char*>(base), size);
+}
+
+// Make sure a variant lies completely within the file.
+
+static bool variant_is_sane(const pack_variant& v, uint64_t size)
+{
+  return v.body_offset <= size && v.body_size <= size - v.body_offset &&
+         v.header_offset <= size && v.header_size <= size - v.header_offset &&
+         v.etag_offset <= size && v.etag_size <= size - v.etag_offset;
+}
+
+void pack_archive::open(const string& path)
+{
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    throw system_error("cannot open pack file '" + path + "'");
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+  {
+    close(fd);
+    throw system_error("cannot stat pack file '" + path + "'");
+  }
+  if (static_cast<uint64_t>(st.st_size) < sizeof(pack_header))
+  {
+    close(fd);
+    throw runtime_error("pack file '" + path + "' is truncated");
+  }
+  void* p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    throw system_error("cannot map pack file '" + path + "'");
+  base = static_cast<const char*>(p);
+  size = st.st_size;
+
+  // Check everything we'll rely on later, so that lookups don't have
+  // to.
+
+  header = reinterpret_cast<const pack_header*>(base);
+  uint64_t buckets_size = (header->bucket_count * sizeof(uint32_t) + 7) & ~static_cast<uint64_t>(7);
+  uint64_t entries_end  = sizeof(pack_header) + buckets_size + header->entry_count * sizeof(pack_entry);
+  const char* problem = 0;
+  if (memcmp(header->magic, pack_magic, sizeof(pack_magic)) != 0)
+    problem = "is not a pack file";
+  else if (header->byteorder != pack_byteorder)
+    problem = "was made on a machine with a different byte order";
+  else if (header->version != pack_version)
+    problem = "has an unsupported version";
+  else if (header->file_size != size || header->bucket_count == 0 || entries_end > size)
+    problem = "is truncated";
+  else
+  {
+    buckets = reinterpret_cast<const uint32_t*>(base + sizeof(pack_header));
+    entries = reinterpret_cast<const pack_entry*>(base + sizeof(pack_header) + buckets_size);
+    for (uint32_t i = 0; i < header->bucket_count && !problem; ++i)
+      if (buckets[i] != pack_none && buckets[i] >= header->entry_count)
+        problem = "is corrupt";
+    for (uint32_t i = 0; i < header->entry_count && !problem; ++i)
+    {
+      const pack_entry& e = entries[i];
+      if ((e.next != pack_none && e.next >= header->entry_count) ||
+          e.key_offset > size || e.key_size > size - e.key_offset ||
+          !variant_is_sane(e.identity, size) || !variant_is_sane(e.gzip, size))
+        problem = "is corrupt";
+    }
+  }
+  if (problem)
+  {
+    munmap(p, size);
+    base = 0;
+    throw runtime_error("pack file '" + path + "' " + problem);
+  }
+}
+
+const pack_entry* pack_archive::find(const char* key, size_t len) const
+{
+  uint32_t h = pack_hash(key, len);
+  unsigned long steps = 0;
+  for (uint32_t i = buckets[h % header->bucket_count]; i != pack_none; i = entries[i].next)
+  {
+    const pack_entry& e = entries[i];
+    if (e.hash == h && e.key_size == len && memcmp(base + e.key_offset, key, len) == 0)
+      return &e;
+    if (++steps > header->entry_count)   // a corrupt chain; don't loop forever
+      break;
+  }
+  return 0;
+}
+
+// The document root snapshot, if the server has been given one.
+
+pack_archive document_pack;
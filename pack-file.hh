@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACK_FILE_HH_INCLUDED
+#define PACK_FILE_HH_INCLUDED
+
+#include <string>
+#include <stdint.h>
+
+/*
+   A pack file is a read-only snapshot of a document root, made by
+   httpd-pack. It consists of
+
+     pack_header
+     uint32_t   buckets[bucket_count]   (padded to a multiple of 8 bytes)
+     pack_entry entries[entry_count]
+     the data: keys, header fragments, entity tags, and bodies
+
+   All integers are in the byte order of the machine that made the
+   file; the header records it, so that a foreign file is rejected.
+   Entries are found by hashing their key -- "hostname/path" -- into
+   the bucket array and following the chain of next indices.
+
+   Every entry has an identity variant and optionally a gzipped one.
+   Each variant carries a pre-built header fragment with the
+   Content-Type, Content-Encoding, Vary, Last-Modified, and ETag
+   headers; the server adds only the status line, Date, Content-Length
+   and the connection headers.
+*/
+
+const char     pack_magic[8]  = { 'M', 'H', 'T', 'T', 'P', 'P', 'A', 'K' };
+const uint32_t pack_version   = 1;
+const uint32_t pack_byteorder = 0x01020304;
+const uint32_t pack_none      = 0xffffffff;
+
+enum pack_entry_flags
+{
+  PACK_DIRECTORY = 1 << 0       // a directory: redirect to "path/"
+};
+
+struct pack_header
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t byteorder;
+  uint32_t bucket_count;
+  uint32_t entry_count;
+  uint64_t file_size;
+};
+
+struct pack_variant
+{
+  uint64_t body_offset;
+  uint64_t body_size;
+  uint64_t header_offset;
+  uint64_t header_size;
+  uint64_t etag_offset;
+  uint64_t etag_size;
+};
+
+struct pack_entry
+{
+  uint64_t     key_offset;
+  uint32_t     key_size;
+  uint32_t     hash;
+  uint32_t     next;
+  uint32_t     flags;
+  int64_t      mtime;
+  pack_variant identity;
+  pack_variant gzip;
+};
+
+// FNV-1a; cheap, and good enough for path names.
+
+inline uint32_t pack_hash(const char* key, size_t len)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; ++i)
+  {
+    h ^= static_cast<unsigned char>(key[i]);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// A pack file mapped into memory.
+
+class pack_archive
+{
+public:
+  pack_archive();
+  ~pack_archive();
+
+  // Map the given file. Throws if it can't be read or isn't a valid
+  // pack file.
+
+  void open(const std::string& path);
+
+  bool is_open() const          { return base != 0; }
+
+  // Look up an entry. Returns 0 if there is none.
+
+  const pack_entry* find(const char* key, size_t len) const;
+
+  const char* data(uint64_t offset) const { return base + offset; }
+
+private:                      // Don't copy me.
+  pack_archive(const pack_archive&);
+  pack_archive& operator= (const pack_archive&);
+
+private:
+  const char*        base;
+  size_t             size;
+  const pack_header* header;
+  const uint32_t*    buckets;
+  const pack_entry*  entries;
+};
+
+extern pack_archive document_pack;
+
+#endif // PACK_FILE_HH_INCLUDED
@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "peer-table.hh"
+#include "statistics.hh"
+
+using namespace std;
+
+// The table has a fixed number of slots, a power of two. A peer is
+// looked for in no more than max_probes slots, starting at the one its
+// key hashes to.
+
+static const size_t table_size = 8192;
+static const size_t max_probes = 16;
+
+// The token bucket of a peer holds at most one second's worth of
+// requests; we can't count more than this many per second.
+
+static const unsigned int max_request_rate = 1000000;
+
+static inline size_t hash_key(const peer_key& key)
+{
+  uint32_t h = 0;
+  for (size_t i = 0; i < sizeof(key.addr); i += sizeof(uint32_t))
+  {
+    uint32_t word;
+    memcpy(&word, key.addr + i, sizeof(word));
+    h = (h ^ word) * 2654435761u;
+  }
+  return h ^ (h >> 16);
+}
+
+peer_key make_peer_key(const sockaddr& addr)
+{
+  peer_key key;
+  memset(key.addr, 0, sizeof(key.addr));
+  if (addr.sa_family == AF_INET)
+  {
+    const sockaddr_in& sin = reinterpret_cast<const sockaddr_in&>(addr);
+    key.addr[10] = key.addr[11] = 0xff;
+    memcpy(key.addr + 12, &sin.sin_addr, 4);
+  }
+  else if (addr.sa_family == AF_INET6)
+  {
+    const sockaddr_in6& sin6 = reinterpret_cast<const sockaddr_in6&>(addr);
+    memcpy(key.addr, &sin6.sin6_addr, sizeof(key.addr));
+    if (!IN6_IS_ADDR_V4MAPPED(&sin6.sin6_addr))
+      memset(key.addr + 8, 0, 8);
+  }
+  return key;
+}
+
+void format_peer_address(const sockaddr& addr, char* buf, size_t size)
+{
+  const void* ip = 0;
+  int family     = addr.sa_family;
+  if (family == AF_INET)
+    ip = &reinterpret_cast<const sockaddr_in&>(addr).sin_addr;
+  else if (family == AF_INET6)
+  {
+    const in6_addr& ip6 = reinterpret_cast<const sockaddr_in6&>(addr).sin6_addr;
+    ip = &ip6;
+    if (IN6_IS_ADDR_V4MAPPED(&ip6))
+    {
+      family = AF_INET;
+      ip     = ip6.s6_addr + 12;
+    }
+  }
+  if (!ip || !inet_ntop(family, ip, buf, size))
+    snprintf(buf, size, "%s", (family == AF_UNIX) ? "unix" : "unknown");
+}
+
+bool is_loopback_address(const sockaddr& addr)
+{
+  if (addr.sa_family == AF_INET)
+    return (ntohl(reinterpret_cast<const sockaddr_in&>(addr).sin_addr.s_addr) >> 24) == 127;
+  if (addr.sa_family == AF_INET6)
+  {
+    const in6_addr& ip6 = reinterpret_cast<const sockaddr_in6&>(addr).sin6_addr;
+    return IN6_IS_ADDR_LOOPBACK(&ip6) || (IN6_IS_ADDR_V4MAPPED(&ip6) && ip6.s6_addr[12] == 127);
+  }
+  return false;
+}
+
+peer_table::peer_table()
+    : max_connections(0), request_rate(0), rejected_connection_count(0),
+      rejected_request_count(0), untracked_count(0)
+{
+}
+
+void peer_table::set_limits(unsigned int connections, unsigned int rate)
+{
+  max_connections = connections;
+  request_rate    = (rate < max_request_rate) ? rate : max_request_rate;
+  slot empty;
+  memset(&empty, 0, sizeof(empty));
+  slots.assign((max_connections || request_rate) ? table_size : 0, empty);
+}
+
+void peer_table::refill(slot& s, uint32_t now) const
+{
+  uint64_t tokens = s.tokens + static_cast<uint64_t>(now - s.updated) * request_rate;
+  s.tokens  = static_cast<uint32_t>(min(tokens, static_cast<uint64_t>(request_rate) * 1000));
+  s.updated = now;
+}
+
+/*
+   Slots are never emptied, only reused, so the search for a peer can
+   stop at the first empty slot. On the way, we remember the first slot
+   that has become reusable, in case the peer isn't in the table.
+*/
+
+peer_table::slot* peer_table::find(const peer_key& key, bool create)
+{
+  if (slots.empty() || key.empty())
+    return 0;
+  uint32_t now = monotonic_coarse_usec() / 1000;
+  size_t mask  = slots.size() - 1;
+  slot* reusable = 0;
+  for (size_t n = 0, i = hash_key(key) & mask; n < max_probes; ++n, i = (i + 1) & mask)
+  {
+    slot& s = slots[i];
+    if (s.key == key)
+      return &s;
+    if (s.key.empty())
+    {
+      if (!reusable)
+        reusable = &s;
+      break;
+    }
+    if (!reusable && s.connections == 0)
+    {
+      refill(s, now);
+      if (s.tokens == request_rate * 1000)
+        reusable = &s;
+    }
+  }
+  if (!create || !reusable)
+    return 0;
+  reusable->key         = key;
+  reusable->connections = 0;
+  reusable->tokens      = request_rate * 1000;
+  reusable->updated     = now;
+  return reusable;
+}
+
+bool peer_table::admit(const peer_key& key, bool& counted)
+{
+  counted = false;
+  slot* s = find(key, true);
+  if (!s)
+  {
+    if (enabled() && !key.empty())
+      ++untracked_count;
+    return true;
+  }
+  refill(*s, monotonic_coarse_usec() / 1000);
+  if ((max_connections && s->connections >= max_connections) || (request_rate && s->tokens < 1000))
+  {
+    ++rejected_connection_count;
+    return false;
+  }
+  ++s->connections;
+  counted = true;
+  return true;
+}
+
+void peer_table::release(const peer_key& key)
+{
+  slot* s = find(key, false);
+  if (s && s->connections > 0)
+    --s->connections;
+}
+
+bool peer_table::charge_request(const peer_key& key)
+{
+  if (!request_rate)
+    return true;
+  slot* s = find(key, true);
+  if (!s)
+    return true;
+  refill(*s, monotonic_coarse_usec() / 1000);
+  if (s->tokens < 1000)
+  {
+    ++rejected_request_count;
+    return false;
+  }
+  s->tokens -= 1000;
+  return true;
+}
+
+peer_table peers;
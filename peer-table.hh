@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PEER_TABLE_HH_INCLUDED
+#define PEER_TABLE_HH_INCLUDED
+
+#include <vector>
+#include <cstring>
+#include <cstddef>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Peers are identified by their binary address as an IPv6 address;
+// IPv4 addresses are mapped into that space. IPv6 peers usually have
+// a whole /64 network to themselves, so that's what identifies them.
+// Peers we don't know an address of, like those connecting through a
+// Unix domain socket, have an empty key and aren't limited.
+
+struct peer_key
+{
+  unsigned char addr[16];
+
+  bool empty() const
+  {
+    static const unsigned char zero[16] = { 0 };
+    return std::memcmp(addr, zero, sizeof(addr)) == 0;
+  }
+
+  bool operator== (const peer_key& other) const
+  {
+    return std::memcmp(addr, other.addr, sizeof(addr)) == 0;
+  }
+};
+
+peer_key make_peer_key(const sockaddr& addr);
+
+// Write the peer's address in human-readable form into the buffer.
+
+void format_peer_address(const sockaddr& addr, char* buf, size_t size);
+
+// Is this a loopback address of this host?
+
+bool is_loopback_address(const sockaddr& addr);
+
+// This class keeps track of the connections and the request rate of
+// every peer, so that a single client can't take the server for
+// itself. It's a hash table of fixed size with open addressing:
+// memory use doesn't depend on the number of peers, and a lookup
+// touches a few adjacent slots at most.
+//
+// Slots of peers that have no connections left and whose token bucket
+// has filled up again carry no information anymore and are reused. If
+// no slot can be found for a new peer -- because the table is full of
+// active ones --, that peer isn't limited at all. Neither are peers
+// with an empty key.
+
+class peer_table
+{
+public:
+  peer_table();
+
+  // Set the maximum number of concurrent connections per peer and the
+  // number of requests per peer and second. Zero means no limit. With
+  // no limits at all, the table does nothing.
+
+  void set_limits(unsigned int max_connections, unsigned int request_rate);
+
+  bool enabled() const          { return !slots.empty(); }
+
+  // A new connection. Returns false if the peer has reached one of its
+  // limits. Otherwise, counted tells whether the connection counts
+  // against the peer's limit; if so, release() must be called when
+  // it's closed. Peers that have no slot aren't counted.
+
+  bool admit(const peer_key& key, bool& counted);
+  void release(const peer_key& key);
+
+  // A new request. Returns false if the peer has exceeded its request
+  // rate.
+
+  bool charge_request(const peer_key& key);
+
+  // Statistics.
+
+  unsigned long rejected_connections() const { return rejected_connection_count; }
+  unsigned long rejected_requests() const    { return rejected_request_count; }
+  unsigned long untracked() const            { return untracked_count; }
+
+private:                      // Don't copy me.
+  peer_table(const peer_table&);
+  peer_table& operator= (const peer_table&);
+
+private:
+  // The tokens are counted in thousandths of a request; the time is
+  // in milliseconds and may wrap around.
+
+  struct slot
+  {
+    peer_key key;
+    uint32_t connections;
+    uint32_t tokens;
+    uint32_t updated;
+  };
+
+  slot* find(const peer_key& key, bool create);
+  void  refill(slot& s, uint32_t now) const;
+
+  std::vector<slot> slots;
+  unsigned int      max_connections;
+  unsigned int      request_rate;
+  unsigned long     rejected_connection_count;
+  unsigned long     rejected_request_count;
+  unsigned long     untracked_count;
+};
+
+extern peer_table peers;
+
+#endif // PEER_TABLE_HH_INCLUDED
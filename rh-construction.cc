@@ -22,7 +22,6 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <arpa/inet.h>
 #include "system-error.hh"
 #include "RequestHandler.hh"
 #include "config.hh"
@@ -31,6 +30,21 @@
 using namespace std;
 
 unsigned int RequestHandler::instances = 0;
+bool RequestHandler::draining = false;
+RequestHandler::instance_list_t RequestHandler::all_instances;
+unsigned int RequestHandler::connections_in_state[TERMINATE + 1];
+log_histogram RequestHandler::state_histograms[TERMINATE + 1];
+
+const char* const RequestHandler::state_names[TERMINATE + 1] =
+{
+  "read-request-line",
+  "read-request-header",
+  "read-request-body",
+  "setup-reply",
+  "copy-file",
+  "flush-buffer",
+  "terminate"
+};
 
 const RequestHandler::state_fun_t RequestHandler::state_handlers[] =
 {
@@ -43,15 +57,17 @@ const RequestHandler::state_fun_t RequestHandler::state_handlers[] =
   &RequestHandler::terminate
 };
 
-RequestHandler::RequestHandler(scheduler& sched, int fd, const sockaddr_in& sin)
-    : mysched(sched), sockfd(fd), filefd(-1)
+RequestHandler::RequestHandler(scheduler& sched, int fd, const sockaddr& peer_addr, bool counted)
+    : state(READ_REQUEST_LINE), mysched(sched), sockfd(fd), peer_counted(counted), corked(false), nodelay(false),
+      connection_bytes_sent(0), requests_served(0), state_entered(monotonic_coarse_usec()), time_in_state(),
+      states_visited(0), filefd(-1), map_base(0), memory_body(0), memory_body_end(0)
 {
   TRACE();
 
-  // Store the peer's address as ASCII string.
-
-  if (inet_ntop(AF_INET, &sin.sin_addr, peer_address, sizeof(peer_address)) == 0)
-    throw system_error("inet_ntop() failed");
+  set_peer(peer_addr);
+  tcp_socket          = (peer_addr.sa_family != AF_UNIX);
+  expect_proxy_header = !tcp_socket;
+  nodelay             = !tcp_socket;
 
   // Set socket parameters.
 
@@ -68,11 +84,27 @@ RequestHandler::RequestHandler(scheduler& sched, int fd, const sockaddr_in& sin)
 
   line_buffer.reset( new char[config->max_line_length] );
 
-  // Initialize internal variables.
+  // Initialize internal variables. The state timers are set up above,
+  // because reset() accounts for the time spent in the current state.
 
+  tokens         = config->rate_limit;
+  tokens_updated = state_entered;
+  throttled      = false;
+  ++connections_in_state[state];
   reset();
   debug(("%d: Accepted new connection from peer '%s'.", sockfd, peer_address));
   ++instances;
+  instance_pos = all_instances.insert(all_instances.end(), this);
+}
+
+// Store the peer's address as ASCII string, and in binary for the
+// peer table. Peers on the loopback interface may see the status page.
+
+void RequestHandler::set_peer(const sockaddr& addr)
+{
+  format_peer_address(addr, peer_address, sizeof(peer_address));
+  peer          = make_peer_key(addr);
+  peer_is_local = is_loopback_address(addr);
 }
 
 void RequestHandler::reset()
@@ -81,8 +113,9 @@ void RequestHandler::reset()
 
   // Freshen up the internal variables.
 
-  state = READ_REQUEST_LINE;
+  set_state(READ_REQUEST_LINE);
 
+  unmap_file();
   if (filefd >= 0)
   {
     close(filefd);
@@ -91,8 +124,44 @@ void RequestHandler::reset()
 
   request = HTTPRequest();
   request.start_up_time = time(0);
-
-  go_to_read_mode();
+  header_size  = 0;
+  header_count = 0;
+  multipart_boundary.clear();
+  content_encoding.clear();
+  etag.clear();
+  vary_on_encoding = false;
+  chunked          = false;
+  memory_body      = 0;
+  memory_body_end  = 0;
+  memory_body_owner.reset();
+#ifdef HAVE_LIBZ
+  encoder.reset();
+#endif
+  compressed_copy.reset();
+
+  // If the next request has arrived already, its clock is running.
+  // Either way, the peer has only so much time to send it; we've
+  // entered READ_REQUEST_LINE just now.
+
+  request_start   = read_buffer.empty() ? 0 : monotonic_usec();
+  uint64_t timeout = (request_start != 0) ? config->header_timeout : config->first_byte_timeout;
+  read_deadline   = timeout ? state_entered + timeout * 1000000 : 0;
+  rate_window_start = 0;
+  rate_window_bytes = 0;
+  first_byte_sent = 0;
+  reply_start      = connection_bytes_sent + write_buffer.size();
+  cache_status     = 0;
+  access_logged    = false;
+  states_visited  = 0;
+  for (unsigned int i = 0; i <= TERMINATE; ++i)
+    time_in_state[i] = 0;
+
+  // If replies to pipelined requests are still waiting to be sent, we
+  // stay in write mode; fd_is_writable() switches to reading once the
+  // write_buffer is empty.
+
+  if (write_buffer.empty())
+    go_to_read_mode();
 }
 
 RequestHandler::~RequestHandler()
@@ -101,12 +170,64 @@ RequestHandler::~RequestHandler()
 
   debug(("%d: Closing connection to peer '%s'.", sockfd, peer_address));
 
+  // Replies that haven't been logged yet were cut short.
+
+  if (!pending_logs.empty() || (!access_logged && !request.status_code.empty()))
+  {
+    try
+    {
+      log_pending_replies(true);
+      if (!access_logged && !request.status_code.empty())
+        log_access(true);
+    }
+    catch (const exception& e)
+    {
+      error("cannot log aborted request from %s: %s", peer_address, e.what());
+    }
+  }
+
   --instances;
+  all_instances.erase(instance_pos);
+  --connections_in_state[state];
+  if (peer_counted)
+    peers.release(peer);
 
   mysched.remove_handler(sockfd);
 
   close(sockfd);
 
+  unmap_file();
   if (filefd >= 0)
     close(filefd);
 }
+
+// A connection is idle if it has been answered and the peer hasn't
+// sent another request yet. Closing it doesn't lose anything: the peer
+// will send that request to the new server.
+
+unsigned int RequestHandler::close_idle_connections()
+{
+  unsigned int closed = 0;
+  for (instance_list_t::iterator i = all_instances.begin(); i != all_instances.end(); )
+  {
+    RequestHandler* handler = *i++;
+    if (handler->state == READ_REQUEST_LINE && handler->requests_served > 0 &&
+        handler->read_buffer.empty() && handler->write_buffer.empty())
+    {
+      delete handler;
+      ++closed;
+    }
+  }
+  return closed;
+}
+
+unsigned int RequestHandler::close_all_connections()
+{
+  unsigned int closed = 0;
+  while (!all_instances.empty())
+  {
+    delete all_instances.front();
+    ++closed;
+  }
+  return closed;
+}
@@ -17,46 +17,441 @@
 
 #include <config.h>
 
+#ifdef HAVE_SYS_SENDFILE_H
+#  include <sys/sendfile.h>
+#endif
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include "system-error.hh"
 #include "RequestHandler.hh"
+#include "variant-cache.hh"
+#include "config.hh"
 #include "log.hh"
 
 using namespace std;
 
+// pread() starts out with small chunks and doubles their size every
+// time the peer has taken one, up to the maximum.
+
+static const size_t min_chunk_size = 16 * 1024;
+static const size_t max_chunk_size = 256 * 1024;
+
+// When a file is opened, the kernel is asked to read this much of it
+// right away. In mmap mode, we map this much of the file at a time,
+// and dropping pages from the page cache is done in steps of this
+// size.
+
+static const off_t  readahead_size   = 512 * 1024;
+static const size_t map_window_size  = 4 * 1024 * 1024;
+static const off_t  drop_behind_step = 1024 * 1024;
+
+// Replies that can be completed with this many write quanta are sent
+// in one go.
+
+static const off_t short_reply_quanta = 4;
+
+/*
+   Before a file is copied, we tell the kernel to read it sequentially,
+   which makes its readahead more aggressive, and have it start on the
+   first part of the reply. Files larger than --drop-behind-threshold
+   are dropped from the page cache as they're sent, so that a single
+   large download doesn't push the small, hot files out of it.
+*/
+
+void RequestHandler::prepare_copy_file()
+{
+  use_sendfile   = true;
+  use_mmap       = config->use_mmap;
+  chunk_size     = min_chunk_size;
+  drop_behind    = config->drop_behind_threshold > 0 &&
+                   file_stat.st_size >= config->drop_behind_threshold;
+  dropped_offset = 0;
+#ifdef HAVE_POSIX_FADVISE
+  if (request.ranges.empty())
+  {
+    posix_fadvise(filefd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(filefd, 0, readahead_size, POSIX_FADV_WILLNEED);
+  }
+  else
+    posix_fadvise(filefd, request.ranges.front().first, readahead_size, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/*
+   Drop what we've sent from the page cache. Pages that are still in
+   use -- mapped by us or queued in the socket -- are left alone by the
+   kernel, so in mmap mode we only drop what lies before the current
+   window.
+*/
+
+void RequestHandler::drop_behind_cursor()
+{
+#ifdef HAVE_POSIX_FADVISE
+  off_t end = map_base ? map_offset : file_offset;
+  if (drop_behind && end - dropped_offset >= drop_behind_step)
+  {
+    posix_fadvise(filefd, dropped_offset, end - dropped_offset, POSIX_FADV_DONTNEED);
+    dropped_offset = end;
+  }
+#endif
+}
+
+/*
+   The scheduler services the writable connections one after another,
+   so a few peers pulling large files over fast links could keep all
+   others waiting. That's why a long transfer sends no more than one
+   --write-quantum per writable event, while replies that are almost
+   done get to finish: the fewer bytes remain, the sooner a reply is
+   out of the way. With a --rate-limit, the connection's token bucket
+   limits the budget further.
+*/
+
+size_t RequestHandler::write_budget(off_t remaining)
+{
+  off_t budget = remaining;
+  off_t quantum = config->write_quantum;
+  if (quantum > 0 && remaining > short_reply_quanta * quantum)
+    budget = quantum;
+  if (config->rate_limit > 0 && budget > tokens)
+    budget = tokens;
+  return static_cast<size_t>(min(budget, static_cast<off_t>(SSIZE_MAX)));
+}
+
+/*
+   Refill the token bucket for the time that has passed. It holds at
+   most one second's worth of data. If it's empty, we stop polling
+   the socket and let the write timeout wake us up; the scheduler
+   counts in seconds, so that's a second later.
+*/
+
+bool RequestHandler::throttle()
+{
+  uint64_t now = monotonic_coarse_usec();
+  uint64_t elapsed = min(now - tokens_updated, static_cast<uint64_t>(1000000));
+  tokens = min(tokens + static_cast<int64_t>(elapsed * config->rate_limit / 1000000),
+               static_cast<int64_t>(config->rate_limit));
+  tokens_updated = now;
+  if (tokens > 0)
+    return false;
+
+  debug(("%d: Bandwidth cap reached; pausing the transfer.", sockfd));
+  scheduler::handler_properties prop;
+  prop.poll_events   = 0;
+  prop.write_timeout = 1;
+  mysched.register_handler(sockfd, *this, prop);
+  throttled = true;
+  return true;
+}
+
+void RequestHandler::unmap_file()
+{
+  if (map_base)
+  {
+    munmap(map_base, map_length);
+    map_base = 0;
+  }
+}
+
 /*
    In COPY_FILE state, all we do is fill up the write_buffer with data
    when it's empty, and if the file is through, we'll go into any of
    the FLUSH_BUFFER states -- depending on whether we support
    persistent connections or not -- to go on.
+
+   The part of the file we're sending is [file_offset, file_end). For
+   byte range requests, that segment is one range at a time; a
+   multipart reply also gets the part header before and the closing
+   boundary after the ranges.
+
+   If the system has sendfile(2), we don't fill the write_buffer at
+   all: once the header has been written, the file is handed to the
+   kernel, which copies it straight from the page cache into the
+   socket. That saves us the copy into user space and one system call
+   per chunk. Should sendfile() refuse to work with the file at hand,
+   we fall back to mmap mode, if enabled, or to pread() for the
+   remainder of the request.
 */
 
 bool RequestHandler::copy_file()
 {
   TRACE();
 
-  if (write_buffer.empty())
+  if (!write_buffer.empty())
+    return false;
+  if (config->rate_limit > 0 && throttle())
+    return false;
+
+  if (memory_body)
+    return copy_memory_body();
+#ifdef HAVE_LIBZ
+  if (encoder)
+    return copy_compressed_file();
+#endif
+
+  if (file_offset >= file_end)
+  {
+    if (next_range < request.ranges.size())
+    {
+      const ByteRange& range = request.ranges[next_range++];
+      file_offset    = range.first;
+      file_end       = range.last + 1;
+      dropped_offset = file_offset;
+      if (multipart_boundary.empty())
+        return true;
+      write_buffer = byterange_part_header(range);
+      return false;
+    }
+
+    if (!multipart_boundary.empty())
+      write_buffer = "\r\n--" + multipart_boundary + "--\r\n";
+    debug(("%d: The complete file is copied: going into FLUSH_BUFFER state.", sockfd));
+    set_state(FLUSH_BUFFER);
+    unmap_file();
+    close(filefd);
+    filefd = -1;
+    return true;
+  }
+
+#ifdef HAVE_SENDFILE
+  if (use_sendfile)
   {
-    char buf[4096];
-    ssize_t rc = read(filefd, buf, sizeof(buf));
+    ssize_t rc = sendfile(sockfd, filefd, &file_offset, write_budget(file_end - file_offset));
     if (rc < 0)
     {
-      if (errno != EINTR)
-        throw system_error(string("read() from file '") + filename + "' failed");
-      else
+      if (errno == EINTR)
         return true;
+      else if (errno == EAGAIN)
+        return false;
+      else if (errno == EINVAL || errno == ENOSYS)
+      {
+        debug(("%d: sendfile() does not support '%s'; falling back to %s.", sockfd, filename.c_str(),
+               (use_mmap ? "mmap()" : "pread()")));
+        use_sendfile = false;
+        return true;
+      }
+      else
+        throw system_error(string("sendfile() of file '") + filename + "' failed");
     }
-    else if (rc == 0)
+    else if (rc > 0)
     {
-      debug(("%d: The complete file is copied: going into FLUSH_BUFFER state.", sockfd));
-      state = FLUSH_BUFFER;
-      close(filefd);
-      filefd = -1;
+      bytes_written(rc);
+      drop_behind_cursor();
     }
     else
     {
-      write_buffer.assign(buf, rc);
+      // The file has been truncated while we were sending it. There
+      // is nothing we can do but to stop here; the peer will notice
+      // that Content-Length doesn't match.
+
+      info("File '%s' shrunk while it was being sent to %s.", filename.c_str(), peer_address);
+      file_offset = file_end;
+      next_range  = request.ranges.size();
     }
+    return file_offset >= file_end;
+  }
+#endif
+
+  if (use_mmap)
+    return copy_mapped_file();
+
+  size_t len = min(chunk_size, write_budget(file_end - file_offset));
+  write_buffer.resize(len);
+  ssize_t rc = pread(filefd, &write_buffer[0], len, file_offset);
+  if (rc < 0)
+  {
+    write_buffer.clear();
+    if (errno != EINTR)
+      throw system_error(string("pread() from file '") + filename + "' failed");
+    else
+      return true;
+  }
+  else if (rc == 0)
+  {
+    write_buffer.clear();
+    info("File '%s' shrunk while it was being sent to %s.", filename.c_str(), peer_address);
+    file_offset = file_end;
+    next_range  = request.ranges.size();
+    return true;
+  }
+  else
+  {
+    write_buffer.resize(rc);
+    file_offset += rc;
+    if (chunk_size < max_chunk_size)
+      chunk_size *= 2;
+    drop_behind_cursor();
   }
 
   return false;
 }
+
+/*
+   In mmap mode, the file is mapped into memory a window at a time and
+   written to the socket from there, which saves the copy into the
+   write_buffer. Touching pages beyond the end of a file that has been
+   truncated would get us killed with SIGBUS, so we check the file's
+   size before mapping every window. That narrows the race, but
+   doesn't close it. If the file can't be mapped, we fall back to
+   pread().
+*/
+
+bool RequestHandler::copy_mapped_file()
+{
+  TRACE();
+
+  if (!map_base || file_offset < map_offset || file_offset >= map_offset + static_cast<off_t>(map_length))
+  {
+    unmap_file();
+    struct stat st;
+    if (fstat(filefd, &st) == -1)
+      throw system_error(string("fstat() of file '") + filename + "' failed");
+    if (st.st_size <= file_offset)
+    {
+      info("File '%s' shrunk while it was being sent to %s.", filename.c_str(), peer_address);
+      file_offset = file_end;
+      next_range  = request.ranges.size();
+      return true;
+    }
+    static const off_t page_size = sysconf(_SC_PAGESIZE);
+    map_offset = file_offset - file_offset % page_size;
+    map_length = min(min(file_end, st.st_size) - map_offset, static_cast<off_t>(map_window_size));
+    void* p = mmap(0, map_length, PROT_READ, MAP_SHARED, filefd, map_offset);
+    if (p == MAP_FAILED)
+    {
+      debug(("%d: Cannot map '%s': %s; falling back to pread().", sockfd, filename.c_str(), strerror(errno)));
+      use_mmap = false;
+      return true;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(p, map_length, MADV_SEQUENTIAL);
+#endif
+    map_base = static_cast<char*>(p);
+  }
+
+  off_t end = min(file_end, map_offset + static_cast<off_t>(map_length));
+  ssize_t rc = write(sockfd, map_base + (file_offset - map_offset), write_budget(end - file_offset));
+  if (rc < 0)
+  {
+    if (errno == EINTR)
+      return true;
+    else if (errno == EAGAIN)
+      return false;
+    else
+      throw system_error("write() failed");
+  }
+  file_offset += rc;
+  bytes_written(rc);
+  drop_behind_cursor();
+  return file_offset >= file_end;
+}
+
+/*
+   A body we have in memory already is written to the socket directly,
+   without going through the write_buffer.
+*/
+
+bool RequestHandler::copy_memory_body()
+{
+  TRACE();
+
+  if (memory_body == memory_body_end)
+  {
+    debug(("%d: The complete body is copied: going into FLUSH_BUFFER state.", sockfd));
+    set_state(FLUSH_BUFFER);
+    memory_body     = 0;
+    memory_body_end = 0;
+    memory_body_owner.reset();
+    return true;
+  }
+
+  ssize_t rc = write(sockfd, memory_body, write_budget(memory_body_end - memory_body));
+  if (rc < 0)
+  {
+    if (errno == EINTR)
+      return true;
+    else if (errno == EAGAIN)
+      return false;
+    else
+      throw system_error("write() failed");
+  }
+  memory_body += rc;
+  bytes_written(rc);
+  return memory_body == memory_body_end;
+}
+
+#ifdef HAVE_LIBZ
+/*
+   When compressing on the fly, we read the file in larger blocks and
+   pass them through the encoder, which may or may not have output for
+   us. Whatever it has goes into the write_buffer -- framed as a chunk
+   if we use chunked transfer encoding. Once the file is through, the
+   complete compressed body is added to the variant cache, so that
+   the next peer asking for this file gets it without any work.
+*/
+
+bool RequestHandler::copy_compressed_file()
+{
+  TRACE();
+
+  char buf[16384];
+  ssize_t rc = pread(filefd, buf, sizeof(buf), file_offset);
+  if (rc < 0)
+  {
+    if (errno != EINTR)
+      throw system_error(string("pread() from file '") + filename + "' failed");
+    else
+      return true;
+  }
+  file_offset += rc;
+
+  bool finish = (rc == 0);
+  string output;
+  encoder->encode(buf, rc, output, finish);
+  encoded_size += output.size();
+  if (compressed_copy)
+  {
+    if (compressed_copy->size() + output.size() <= compressed_variants.capacity() / 8)
+      compressed_copy->append(output);
+    else
+      compressed_copy.reset();
+  }
+
+  if (!output.empty())
+  {
+    if (chunked)
+    {
+      char chunk_header[32];
+      snprintf(chunk_header, sizeof(chunk_header), "%lx\r\n", static_cast<unsigned long>(output.size()));
+      write_buffer.assign(chunk_header);
+      write_buffer.append(output);
+      write_buffer.append("\r\n");
+    }
+    else
+      write_buffer.swap(output);
+  }
+
+  if (finish)
+  {
+    if (chunked)
+      write_buffer.append("0\r\n\r\n");
+    if (compressed_copy)
+      compressed_variants.insert(filename, file_stat, CODING_GZIP, compressed_copy);
+    debug(("%d: The complete file is compressed (%lu to %lu bytes): going into FLUSH_BUFFER state.",
+           sockfd, static_cast<unsigned long>(file_offset), static_cast<unsigned long>(encoded_size)));
+    request.object_size = encoded_size;
+    encoder.reset();
+    compressed_copy.reset();
+    set_state(FLUSH_BUFFER);
+    close(filefd);
+    filefd = -1;
+    return true;
+  }
+
+  // If the encoder swallowed the block without output, go on reading.
+
+  return write_buffer.empty();
+}
+#endif // HAVE_LIBZ
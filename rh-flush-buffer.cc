@@ -18,16 +18,40 @@
 #include <config.h>
 
 #include "RequestHandler.hh"
+#include "HTTPParser.hh"
+#include "config.hh"
 #include "log.hh"
 
 using namespace std;
 
+/*
+   Once a reply has been queued completely, we usually wait until the
+   write_buffer has been sent before we start over with the next
+   request on a persistent connection. If the peer is pipelining,
+   though, and the next request is already waiting in the read_buffer,
+   we go right on: the next reply is appended to the write_buffer, and
+   all of them go out together in as few write() calls as possible. To
+   keep the memory consumption in check, we do that only as long as
+   the write_buffer holds less than max_pipeline_batch bytes.
+*/
+
 bool RequestHandler::flush_buffer()
 {
   TRACE();
 
+  if (use_persistent_connection && !write_buffer.empty() &&
+      write_buffer.size() < config->max_pipeline_batch &&
+      HTTPParser::have_complete_request(read_buffer))
+  {
+    queue_access_log();
+    debug(("%d: Next request is pipelined; restarting without flushing.", sockfd));
+    reset();
+    return true;
+  }
+
   if (write_buffer.empty())
   {
+    uncork();
     log_access();
     if (use_persistent_connection)
     {
@@ -37,7 +61,7 @@ bool RequestHandler::flush_buffer()
     }
     else
     {
-      state = TERMINATE;
+      set_state(TERMINATE);
       if (shutdown(sockfd, SHUT_RDWR) == -1)
         delete this;
     }
@@ -17,6 +17,8 @@
 
 #include <config.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "system-error.hh"
 #include "RequestHandler.hh"
 #include "config.hh"
@@ -25,11 +27,12 @@ using namespace std;
 
 /*
   This callback is invoked every time socket becomes readable. So what
-  we do is to read up to 4kb of data into our line buffer and then
-  jump into the state handlers. They will process the data and remove
-  anything that's been dealt with. If the buffer overflows, it means
-  someone sent us a single header line that was longer than the 4kb
-  buffer limit -- obviously a jerk, so we reject the request.
+  we do is to read data into our line buffer and then jump into the
+  state handlers. They will process the data and remove anything
+  that's been dealt with. We read no more than fits into the 4kb
+  buffer limit, so the read_buffer never grows beyond it. If it's
+  full, it means someone sent us a single header line that was longer
+  than that -- obviously a jerk, so we reject the request.
 */
 
 void RequestHandler::fd_is_readable(int)
@@ -37,9 +40,19 @@ void RequestHandler::fd_is_readable(int)
   TRACE();
   try
   {
+    // The scheduler's read timeout starts over with every byte we get,
+    // so a peer that trickles in its request would never see it. The
+    // deadline doesn't move.
+
+    if (read_deadline != 0 && monotonic_coarse_usec() >= read_deadline)
+    {
+      read_timeout(sockfd);
+      return;
+    }
+
     // Protect against flooding.
 
-    if (read_buffer.size() > config->max_line_length)
+    if (read_buffer.size() >= config->max_line_length)
     {
       protocol_error("This server won't process excessively long\r\n" \
                      "request header lines.\r\n");
@@ -48,7 +61,7 @@ void RequestHandler::fd_is_readable(int)
 
     // Read sockfd stuff into the line buffer.
 
-    ssize_t rc = read(sockfd, line_buffer.get(), config->max_line_length);
+    ssize_t rc = read(sockfd, line_buffer.get(), config->max_line_length - read_buffer.size());
     if (rc < 0)
     {
       if (errno != EINTR)
@@ -60,11 +73,27 @@ void RequestHandler::fd_is_readable(int)
     {
       if (state != READ_REQUEST_LINE || read_buffer.empty() == false)
         info("Connection to %s was terminated by peer.", peer_address);
-      state = TERMINATE;
+      set_state(TERMINATE);
     }
     else
+    {
+      // Time spent waiting for the first byte of a request is idle
+      // time of the connection, not part of the request.
+
+      if (request_start == 0)
+      {
+        request_start = monotonic_usec();
+        state_entered = monotonic_coarse_usec();
+        read_deadline = config->header_timeout ? state_entered + config->header_timeout * 1000000 : 0;
+      }
       read_buffer.append(line_buffer.get(), rc);
 
+      // Have the scheduler time us out by the deadline at the latest.
+
+      if (read_deadline != 0)
+        go_to_read_mode();
+    }
+
     // Call the state handler.
 
     call_state_handler();
@@ -92,6 +121,16 @@ void RequestHandler::fd_is_writable(int)
   TRACE();
   try
   {
+    // Cut off peers that take forever to read the reply.
+
+    if (config->min_send_rate > 0 && (state == COPY_FILE || state == FLUSH_BUFFER) && sending_too_slowly())
+    {
+      info("%s reads the reply slower than %u bytes per second; shutting down",
+           peer_address, config->min_send_rate);
+      delete this;
+      return;
+    }
+
     // If there is output waiting in the write buffer, write it.
 
     if (state != TERMINATE && !write_buffer.empty())
@@ -107,10 +146,20 @@ void RequestHandler::fd_is_writable(int)
       else if (rc == 0)
       {
         info("Connection to %s was terminated by peer.", peer_address);
-        state = TERMINATE;
+        set_state(TERMINATE);
       }
       else
+      {
         write_buffer.erase(0, rc);
+        bytes_written(rc);
+
+        // When we have sent the replies to a batch of pipelined
+        // requests, we need more input before we can go on.
+
+        if (write_buffer.empty() &&
+            (state == READ_REQUEST_LINE || state == READ_REQUEST_HEADER || state == READ_REQUEST_BODY))
+          go_to_read_mode();
+      }
     }
 
     // Call state handler.
@@ -134,7 +183,10 @@ void RequestHandler::fd_is_writable(int)
 void RequestHandler::read_timeout(int)
 {
   TRACE();
-  if (state != READ_REQUEST_LINE || read_buffer.empty() == false)
+  if (request_start != 0 && read_deadline != 0 && monotonic_coarse_usec() >= read_deadline)
+    info("%s didn't send a complete request header within %u seconds; shutting down",
+         peer_address, config->header_timeout);
+  else if (state != READ_REQUEST_LINE || read_buffer.empty() == false)
     info("no activity on connection to %s for %u seconds; shutting down",
          peer_address, config->network_read_timeout);
   delete this;
@@ -143,6 +195,13 @@ void RequestHandler::read_timeout(int)
 void RequestHandler::write_timeout(int)
 {
   TRACE();
+  if (throttled)
+  {
+    debug(("%d: Resuming the transfer.", sockfd));
+    throttled = false;
+    go_to_write_mode();
+    return;
+  }
   info("couldn't send any data to %s for %u seconds; shutting down",
        peer_address, config->network_write_timeout);
   delete this;
@@ -173,9 +232,43 @@ void RequestHandler::go_to_read_mode()
   scheduler::handler_properties prop;
   prop.poll_events   = POLLIN;
   prop.read_timeout  = config->network_read_timeout;
+  if (read_deadline != 0)
+  {
+    uint64_t now = monotonic_coarse_usec();
+    uint64_t remaining = (read_deadline > now) ? (read_deadline - now + 999999) / 1000000 : 1;
+    if (remaining < static_cast<uint64_t>(prop.read_timeout))
+      prop.read_timeout = remaining;
+  }
   mysched.register_handler(sockfd, *this, prop);
 }
 
+/*
+  The send rate is averaged over windows of rate_window microseconds,
+  the first of which begins when we start sending the reply. Stalled
+  peers are caught by the write timeout, but one that reads a byte now
+  and then would keep its connection forever without this check.
+*/
+
+static const uint64_t rate_window = 10 * 1000000;
+
+bool RequestHandler::sending_too_slowly()
+{
+  uint64_t now = monotonic_coarse_usec();
+  if (rate_window_start == 0)
+  {
+    rate_window_start = now;
+    rate_window_bytes = connection_bytes_sent;
+    return false;
+  }
+  if (now - rate_window_start < rate_window)
+    return false;
+  bool too_slow = (connection_bytes_sent - rate_window_bytes) * 1000000 <
+                  config->min_send_rate * (now - rate_window_start);
+  rate_window_start = now;
+  rate_window_bytes = connection_bytes_sent;
+  return too_slow;
+}
+
 void RequestHandler::go_to_write_mode()
 {
   scheduler::handler_properties prop;
@@ -183,3 +276,43 @@ void RequestHandler::go_to_write_mode()
   prop.write_timeout = config->network_write_timeout;
   mysched.register_handler(sockfd, *this, prop);
 }
+
+/*
+  While we're corked, the kernel sends only full frames, so that the
+  reply header and the beginning of the body share a packet even
+  though we write them separately. Uncorking pushes out whatever is
+  left right away instead of letting it wait for Nagle's algorithm.
+  Failing to set these options is not fatal, the reply just goes out
+  in more packets.
+*/
+
+#if defined(TCP_CORK)
+#  define CORK_OPTION TCP_CORK
+#elif defined(TCP_NOPUSH)
+#  define CORK_OPTION TCP_NOPUSH
+#endif
+
+void RequestHandler::cork()
+{
+#ifdef CORK_OPTION
+  if (corked || !tcp_socket)
+    return;
+  int true_flag = 1;
+  if (setsockopt(sockfd, IPPROTO_TCP, CORK_OPTION, &true_flag, sizeof(int)) == -1)
+    debug(("%d: Cannot cork socket: %s", sockfd, strerror(errno)));
+  else
+    corked = true;
+#endif
+}
+
+void RequestHandler::uncork()
+{
+#ifdef CORK_OPTION
+  if (!corked)
+    return;
+  int false_flag = 0;
+  if (setsockopt(sockfd, IPPROTO_TCP, CORK_OPTION, &false_flag, sizeof(int)) == -1)
+    debug(("%d: Cannot uncork socket: %s", sockfd, strerror(errno)));
+  corked = false;
+#endif
+}
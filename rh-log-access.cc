@@ -19,21 +19,25 @@
 
 #include <stdexcept>
 #include <cstdio>
+#include <sstream>
 #include "system-error.hh"
 #include "RequestHandler.hh"
-#include "timestamp-to-string.hh"
-#include "search-and-replace.hh"
+#include "log-format.hh"
 #include "config.hh"
 #include "log.hh"
 
 using namespace std;
 
-static inline string escape_quotes(const string& input)
-{
-  return search_and_replace(input, "\"", "\\\"", true);
-}
+/*
+   The log entry is formatted according to the compiled --log-format
+   and appended to the log file of the virtual host. If the connection
+   broke down before the reply was complete, the destructor logs the
+   request as aborted, so that %O shows how much of it made it out.
+   Replies to pipelined requests that are still queued behind others
+   are logged by log_pending_replies() once they have been written.
+*/
 
-void RequestHandler::log_access()
+void RequestHandler::log_access(bool aborted)
 {
   TRACE();
 
@@ -42,54 +46,147 @@ void RequestHandler::log_access()
 
   if (request.status_code.empty())
   {
-    error("can't write access log entry for connection with %d because there is no status code", peer_address);
+    error("can't write access log entry for connection with %s because there is no status code", peer_address);
     return;
   }
+  access_logged = true;
+
+  log_record rec;
+  rec.peer_address       = peer_address;
+  rec.request            = &request;
+  rec.content_encoding   = &content_encoding;
+  rec.etag               = &etag;
+  rec.cache_status       = cache_status;
+  rec.bytes_sent         = reply_bytes_sent();
+  rec.keepalive_requests = requests_served++;
+  rec.aborted            = aborted;
+  rec.persistent         = use_persistent_connection;
+  account_state_time();
+  record_statistics(request, request_start, first_byte_sent, time_in_state, states_visited,
+                    rec.request_time, rec.time_to_first_byte);
+  write_access_log(rec);
+}
+
+void RequestHandler::queue_access_log()
+{
+  TRACE();
+
+  if (request.status_code.empty())
+  {
+    error("can't write access log entry for connection with %s because there is no status code", peer_address);
+    return;
+  }
+  access_logged = true;
+
+  pending_logs.push_back(pending_log_entry());
+  pending_log_entry& entry = pending_logs.back();
+  entry.request            = request;
+  entry.content_encoding   = content_encoding;
+  entry.etag               = etag;
+  entry.cache_status       = cache_status;
+  entry.keepalive_requests = requests_served++;
+  entry.persistent         = use_persistent_connection;
+  entry.reply_start        = reply_start;
+  entry.reply_end          = connection_bytes_sent + write_buffer.size();
+  entry.request_start      = request_start;
+  entry.first_byte_sent    = first_byte_sent;
+  account_state_time();
+  for (unsigned int i = 0; i <= TERMINATE; ++i)
+    entry.time_in_state[i] = time_in_state[i];
+  entry.states_visited     = states_visited;
+}
+
+void RequestHandler::log_pending_replies(bool aborted)
+{
+  TRACE();
+
+  // Note when the first byte of each queued reply goes out.
+
+  for (deque<pending_log_entry>::iterator i = pending_logs.begin();
+       i != pending_logs.end() && connection_bytes_sent > i->reply_start; ++i)
+    if (i->first_byte_sent == 0)
+      i->first_byte_sent = monotonic_usec();
+
+  while (!pending_logs.empty() && (aborted || connection_bytes_sent >= pending_logs.front().reply_end))
+  {
+    // Take the entry off the queue first, so that it isn't logged
+    // twice if writing the log fails.
+
+    pending_log_entry entry(pending_logs.front());
+    pending_logs.pop_front();
+    uint64_t sent = (connection_bytes_sent < entry.reply_end) ? connection_bytes_sent : entry.reply_end;
+
+    log_record rec;
+    rec.peer_address       = peer_address;
+    rec.request            = &entry.request;
+    rec.content_encoding   = &entry.content_encoding;
+    rec.etag               = &entry.etag;
+    rec.cache_status       = entry.cache_status;
+    rec.bytes_sent         = (sent > entry.reply_start) ? sent - entry.reply_start : 0;
+    rec.keepalive_requests = entry.keepalive_requests;
+    rec.aborted            = sent < entry.reply_end;
+    rec.persistent         = entry.persistent;
+    record_statistics(entry.request, entry.request_start, entry.first_byte_sent,
+                      entry.time_in_state, entry.states_visited,
+                      rec.request_time, rec.time_to_first_byte);
+    write_access_log(rec);
+  }
+}
 
+void RequestHandler::write_access_log(const log_record& rec)
+{
   // Construct the path of the logfile.
 
   string logfile = config->logfile_directory + "/";
-  if (request.host.empty())
+  if (rec.request->host.empty())
     logfile += "no-hostname";
   else
-    logfile += request.host + "-access";
+    logfile += rec.request->host + "-access";
 
-  // Convert the object size now, so that we can write a string.
-  // That's necessary, because in some cases we write "-" rather
-  // than a number.
+  // Format the entry, then open the file and write it.
 
-  char object_size[32];
-  if (request.object_size.empty())
-    strcpy(object_size, "-");
-  else
-  {
-    int len = snprintf(object_size, sizeof(object_size), "%u", request.object_size.data());
-    if (len < 0 || len > static_cast<int>(sizeof(object_size)))
-    {
-      error("internal error while formatting object_size, snprintf() exceeded the internal buffer");
-      // Just kidding.
-    }
-  }
-  // Open it and write the entry.
+  string entry;
+  access_log_format.format(rec, entry);
+  entry += '\n';
 
   FILE* fh = fopen(logfile.c_str(), "a");
   if (fh == 0)
     throw system_error(string("cannot open logfile '") + logfile + "'");
+  size_t written = fwrite(entry.data(), 1, entry.size(), fh);
+  if (fclose(fh) != 0 || written != entry.size())
+    throw system_error(string("cannot write to logfile '") + logfile + "'");
+}
 
-  try
-  {
-    fprintf(fh, "%s - - [%s] \"%s %s HTTP/%u.%u\" %u %s \"%s\" \"%s\"\n",
-            peer_address, time_to_logdate(request.start_up_time).c_str(),
-            request.method.c_str(), escape_quotes(request.url.path).c_str(),
-            request.major_version, request.minor_version,
-            request.status_code.data(), object_size,
-            escape_quotes(request.referer).c_str(),
-            escape_quotes(request.user_agent).c_str());
-  }
-  catch (...)
-  {
-    fclose(fh);
-    throw;
-  }
-  fclose(fh);
+/*
+   Add the request to the server statistics. A reply none of which
+   made it out counts its whole time as time to first byte. Requests that took longer than the configured threshold are logged
+   with a breakdown of where the time went: a long READ_REQUEST_* phase
+   points at a slow client, a long COPY_FILE phase at the disk or the
+   network, and a long SETUP_REPLY phase at us.
+*/
+
+void RequestHandler::record_statistics(const HTTPRequest& req, uint64_t start, uint64_t first_byte,
+                                       const uint64_t state_time[], unsigned int visited,
+                                       uint64_t& total, uint64_t& ttfb)
+{
+  uint64_t now = monotonic_usec();
+  total = start ? now - start : 0;
+  ttfb  = first_byte > start ? first_byte - start : total;
+  server_stats.request_completed(req.status_code.data(), ttfb, total);
+
+  for (unsigned int i = 0; i <= TERMINATE; ++i)
+    if (visited & (1u << i))
+      state_histograms[i].add(state_time[i]);
+
+  if (config->slow_request_threshold == 0 || total < config->slow_request_threshold * 1000ull)
+    return;
+
+  ostringstream breakdown;
+  for (unsigned int i = 0; i <= TERMINATE; ++i)
+    if (visited & (1u << i))
+      breakdown << " " << state_names[i] << "=" << state_time[i] / 1000 << "ms";
+  info("slow request from %s: %s http://%s%s took %lums (first byte after %lums):%s",
+       peer_address, req.method.c_str(), req.host.c_str(), req.url.path.c_str(),
+       static_cast<unsigned long>(total / 1000), static_cast<unsigned long>(ttfb / 1000),
+       breakdown.str().c_str());
 }
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include "RequestHandler.hh"
+#include "HTTPParser.hh"
+#include "timestamp-to-string.hh"
+#include "pack-file.hh"
+#include "config.hh"
+#include "log.hh"
+
+using namespace std;
+
+/*
+   With --pack-file, all documents come from the pack file mapped into
+   memory, and the file system isn't consulted at all. The headers
+   describing the document have been prepared by httpd-pack; we only
+   check the conditional headers and add the headers that depend on
+   the request. Range requests get the complete document, which
+   HTTP allows; we don't announce Accept-Ranges for packed documents.
+*/
+
+bool RequestHandler::setup_packed_reply(const char* path, size_t path_len)
+{
+  TRACE();
+
+  string key;
+  key.reserve(request.host.size() + path_len);
+  key.append(request.host).append(path, path_len);
+  const pack_entry* entry = document_pack.find(key.data(), key.size());
+  if (entry == 0)
+  {
+    file_not_found();
+    return false;
+  }
+  if (entry->flags & PACK_DIRECTORY)
+  {
+    moved_permanently(request.url.path + "/");
+    return false;
+  }
+
+  const pack_variant* variant = &entry->identity;
+  vary_on_encoding = (entry->gzip.body_size != 0);
+  if (vary_on_encoding && !request.accept_encoding.empty() && (request.accept_encoding & CODING_GZIP))
+  {
+    variant          = &entry->gzip;
+    content_encoding = "gzip";
+  }
+  etag.assign(document_pack.data(variant->etag_offset), variant->etag_size);
+
+  decide_persistence();
+
+  if (!request.if_none_match.empty())
+  {
+    if (HTTPParser::if_none_match_applies(request, etag))
+    {
+      debug(("%d: Packed document '%s' has entity tag %s, which matches If-None-Match: Not modified.",
+             sockfd, key.c_str(), etag.c_str()));
+      not_modified();
+      return true;
+    }
+  }
+  else if (!request.if_modified_since.empty() && entry->mtime <= request.if_modified_since)
+  {
+    debug(("%d: Packed document '%s' has not been modified since '%d'.",
+           sockfd, key.c_str(), request.if_modified_since.data()));
+    not_modified();
+    return true;
+  }
+
+  ostringstream buf;
+  buf << "HTTP/1.1 200 OK\r\n";
+  if (!config->server_string.empty())
+    buf << "Server: " << config->server_string << "\r\n";
+  buf << "Date: " << time_to_rfcdate(time(0)) << "\r\n";
+  buf.write(document_pack.data(variant->header_offset), variant->header_size);
+  buf << "Content-Length: " << variant->body_size << "\r\n";
+  if (!request.connection.empty())
+  {
+    if (use_persistent_connection)
+    {
+      buf << "Connection: keep-alive\r\n"
+      << "Keep-Alive: timeout=" << config->network_read_timeout << ", max=100\r\n";
+    }
+    else
+    {
+      buf << "Connection: close\r\n";
+    }
+  }
+  buf << "\r\n";
+  write_buffer       += buf.str();
+  request.status_code = 200;
+  request.object_size = variant->body_size;
+
+  if (request.method == "HEAD")
+  {
+    set_state(FLUSH_BUFFER);
+    debug(("%d: Answering HEAD from pack; going into FLUSH_BUFFER state.", sockfd));
+  }
+  else if (variant->body_size <= config->small_file_threshold)
+  {
+    write_buffer.append(document_pack.data(variant->body_offset), variant->body_size);
+    set_state(FLUSH_BUFFER);
+    debug(("%d: Answering GET from pack in one piece; going into FLUSH_BUFFER state.", sockfd));
+  }
+  else
+  {
+    cork();
+    memory_body     = document_pack.data(variant->body_offset);
+    memory_body_end = memory_body + variant->body_size;
+    set_state(COPY_FILE);
+    debug(("%d: Answering GET from pack; going into COPY_FILE state.", sockfd));
+  }
+
+  if (state == FLUSH_BUFFER)
+    return send_immediately();
+  go_to_write_mode();
+  return true;
+}
@@ -29,6 +29,6 @@ bool RequestHandler::get_request_body()
   // We ain't reading any bodies yet.
 
   debug(("%d: No request body; going into SETUP_REPLY state.", sockfd));
-  state = SETUP_REPLY;
+  set_state(SETUP_REPLY);
   return true;
 }
@@ -19,6 +19,7 @@
 
 #include "RequestHandler.hh"
 #include "HTTPParser.hh"
+#include "config.hh"
 #include "log.hh"
 
 using namespace std;
@@ -27,18 +28,23 @@ bool RequestHandler::get_request_header()
 {
   TRACE();
 
-  // An empty line will terminate the request header.
+  // An empty line will terminate the request header. The header
+  // deadline doesn't apply to what follows; a request body is subject
+  // to the ordinary read timeout, the reply to --min-send-rate.
 
   if (read_buffer.size() >= 2 && read_buffer[0] == '\r' && read_buffer[1] == '\n')
   {
     read_buffer.erase(0, 2);
+    read_deadline = 0;
     debug(("%d: Request header is complete; going into READ_REQUEST_BODY state.", sockfd));
-    state = READ_REQUEST_BODY;
+    set_state(READ_REQUEST_BODY);
     return true;
   }
 
   // If we do have a complete header line in the read buffer,
-  // process it. If not, we need more I/O before we can proceed.
+  // process it. If not, we need more I/O before we can proceed. Lines
+  // are dealt with as they come in, so we never hold more than one of
+  // them, but the header as a whole must stay within its limits, too.
 
   if (HTTPParser::have_complete_header_line(read_buffer))
   {
@@ -46,6 +52,15 @@ bool RequestHandler::get_request_header()
     size_t len = http_parser.parse_header(name, data, read_buffer);
     if (len > 0)
     {
+      header_size += len;
+      if (++header_count > config->max_header_count || header_size > config->max_header_size)
+      {
+        info("Peer %s sent a request header larger than %u lines or %u bytes.",
+             peer_address, config->max_header_count, config->max_header_size);
+        protocol_error("This server won't process excessively large\r\n" \
+                       "request headers.\r\n");
+        return false;
+      }
       if (strcasecmp("Host", name.c_str()) == 0)
       {
         if (http_parser.parse_host_header(request, data) == 0)
@@ -68,6 +83,43 @@ bool RequestHandler::get_request_header()
         else
           debug(("%d: Read If-Modified-Since header: timestamp = '%d'", sockfd, request.if_modified_since.data()));
       }
+      else if (strcasecmp("If-None-Match", name.c_str()) == 0)
+      {
+        if (http_parser.parse_if_none_match_header(request, data) == 0)
+        {
+          info("Ignoring malformed If-None-Match header from peer %s: '%s'.",
+               peer_address, data.c_str());
+        }
+        else
+          debug(("%d: Read If-None-Match header: %u entity tag(s)", sockfd,
+                 static_cast<unsigned int>(request.if_none_match.size())));
+      }
+      else if (strcasecmp("Range", name.c_str()) == 0)
+      {
+        if (http_parser.parse_range_header(request, data) == 0)
+        {
+          info("Ignoring malformed Range header from peer %s: '%s'.",
+               peer_address, data.c_str());
+        }
+        else
+          debug(("%d: Read Range header: %u range(s)", sockfd,
+                 static_cast<unsigned int>(request.ranges.size())));
+      }
+      else if (strcasecmp("If-Range", name.c_str()) == 0)
+      {
+        debug(("%d: Read If-Range header: data = '%s'", sockfd, data.c_str()));
+        request.if_range = data;
+      }
+      else if (strcasecmp("Accept-Encoding", name.c_str()) == 0)
+      {
+        if (http_parser.parse_accept_encoding_header(request, data) == 0)
+        {
+          info("Ignoring malformed Accept-Encoding header from peer %s: '%s'.",
+               peer_address, data.c_str());
+        }
+        else
+          debug(("%d: Read Accept-Encoding header: codings = %#x", sockfd, request.accept_encoding.data()));
+      }
       else if (strcasecmp("Connection", name.c_str()) == 0)
       {
         debug(("%d: Read Connection header: data = '%s'", sockfd, data.c_str()));
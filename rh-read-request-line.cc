@@ -17,6 +17,13 @@
 
 #include <config.h>
 
+#include <algorithm>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "RequestHandler.hh"
 #include "HTTPParser.hh"
 #include "urldecode.hh"
@@ -28,6 +35,9 @@ bool RequestHandler::get_request_line()
 {
   TRACE();
 
+  if (expect_proxy_header && !read_proxy_header())
+    return false;
+
   if (read_buffer.find("\r\n") != string::npos)
   {
     size_t len = http_parser.parse_request_line(request, read_buffer);
@@ -41,7 +51,8 @@ bool RequestHandler::get_request_line()
              request.url.path.c_str(), request.url.query.c_str()));
 
       read_buffer.erase(0, len);
-      state = READ_REQUEST_HEADER;
+      header_size += len;
+      set_state(READ_REQUEST_HEADER);
       return true;
     }
     else
@@ -53,3 +64,100 @@ bool RequestHandler::get_request_line()
 
   return false;
 }
+
+/*
+  A proxy that talks to us through a Unix domain socket may precede
+  the first request with a line in the format of version 1 of the
+  PROXY protocol, like
+
+    PROXY TCP4 192.0.2.1 198.51.100.7 56324 80\r\n
+
+  which tells us who the real peer is. From then on, that's the peer
+  we log and whose limits apply. "PROXY UNKNOWN" leaves us with the
+  proxy as the peer. Connections that don't start with "PROXY " have
+  no such line.
+*/
+
+static const char   proxy_signature[]     = "PROXY ";
+static const size_t proxy_signature_len   = sizeof(proxy_signature) - 1;
+static const size_t max_proxy_header_size = 107; // as given by the specification
+
+static bool parse_proxy_header(const string& line, sockaddr_storage& addr)
+{
+  vector<string> words;
+  for (size_t pos = 0; pos <= line.size(); )
+  {
+    size_t end = line.find(' ', pos);
+    if (end == string::npos)
+      end = line.size();
+    words.push_back(line.substr(pos, end - pos));
+    pos = end + 1;
+  }
+  if (words.size() >= 2 && words[1] == "UNKNOWN")
+    return true;
+  if (words.size() != 6)
+    return false;
+  for (size_t i = 4; i < 6; ++i)
+  {
+    if (words[i].empty() || words[i].size() > 5 || words[i].find_first_not_of("0123456789") != string::npos ||
+        atoi(words[i].c_str()) > 65535)
+      return false;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  if (words[1] == "TCP4")
+  {
+    sockaddr_in& sin = reinterpret_cast<sockaddr_in&>(addr);
+    sin.sin_family   = AF_INET;
+    sin.sin_port     = htons(atoi(words[4].c_str()));
+    return inet_pton(AF_INET, words[2].c_str(), &sin.sin_addr) == 1;
+  }
+  else if (words[1] == "TCP6")
+  {
+    sockaddr_in6& sin6 = reinterpret_cast<sockaddr_in6&>(addr);
+    sin6.sin6_family   = AF_INET6;
+    sin6.sin6_port     = htons(atoi(words[4].c_str()));
+    return inet_pton(AF_INET6, words[2].c_str(), &sin6.sin6_addr) == 1;
+  }
+  return false;
+}
+
+bool RequestHandler::read_proxy_header()
+{
+  TRACE();
+
+  size_t len = min(read_buffer.size(), proxy_signature_len);
+  if (read_buffer.compare(0, len, proxy_signature, len) != 0)
+  {
+    expect_proxy_header = false;
+    return true;
+  }
+
+  size_t eol = read_buffer.find("\r\n");
+  if (eol == string::npos && read_buffer.size() < max_proxy_header_size)
+    return false;
+  expect_proxy_header = false;
+
+  sockaddr_storage addr;
+  addr.ss_family = AF_UNSPEC;
+  if (eol == string::npos || eol + 2 > max_proxy_header_size || !parse_proxy_header(read_buffer.substr(0, eol), addr))
+  {
+    info("Proxy %s sent a malformed PROXY protocol header.", peer_address);
+    protocol_error("The PROXY protocol header you sent was syntactically incorrect.\r\n");
+    return false;
+  }
+  read_buffer.erase(0, eol + 2);
+
+  if (addr.ss_family != AF_UNSPEC)
+  {
+    set_peer(reinterpret_cast<const sockaddr&>(addr));
+    debug(("%d: Read PROXY protocol header: peer = '%s'", sockfd, peer_address));
+    if (!peers.admit(peer, peer_counted))
+    {
+      info("Peer %s has reached its limits; refusing its connection through the proxy.", peer_address);
+      too_many_requests();
+      return false;
+    }
+  }
+  return true;
+}
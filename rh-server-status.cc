@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include "RequestHandler.hh"
+#include "variant-cache.hh"
+#include "peer-table.hh"
+#include "timestamp-to-string.hh"
+#include "config.hh"
+#include "log.hh"
+
+using namespace std;
+
+/*
+   The status page reports the server's counters as they are right
+   now: the connections by state, the requests and bytes served, the
+   reply codes, and the latency histograms -- overall and per state.
+   Latencies are given in microseconds; the percentiles are the upper
+   bound of the histogram bucket they fall into. With the query "?json"
+   the report comes as a JSON object rather than plain text.
+*/
+
+static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+static const char* const percentile_names[] = { "p50", "p90", "p99", "p999" };
+static const size_t percentile_count = sizeof(percentiles) / sizeof(percentiles[0]);
+
+static void print_histogram(ostream& os, const char* name, const log_histogram& h)
+{
+  os << name << ": count=" << h.count();
+  for (size_t i = 0; i < percentile_count; ++i)
+    os << " " << percentile_names[i] << "=" << h.percentile(percentiles[i]);
+  os << "\n";
+  for (unsigned int n = 0; n < log_histogram::buckets; ++n)
+    if (h.bucket(n) != 0)
+      os << "  <" << (static_cast<uint64_t>(1) << (n + 1)) << ": " << h.bucket(n) << "\n";
+}
+
+static void print_histogram_json(ostream& os, const log_histogram& h)
+{
+  os << "{ \"count\": " << h.count();
+  for (size_t i = 0; i < percentile_count; ++i)
+    os << ", \"" << percentile_names[i] << "\": " << h.percentile(percentiles[i]);
+  os << ", \"buckets\": [";
+  for (unsigned int n = 0; n < log_histogram::buckets; ++n)
+    os << (n ? ", " : "") << h.bucket(n);
+  os << "] }";
+}
+
+void RequestHandler::server_status()
+{
+  TRACE();
+  debug(("%d: Answering status request; going into COPY_FILE state.", sockfd));
+
+  bool json = (request.url.query == "json" || request.url.query == "format=json");
+  time_t now = time(0);
+
+  ostringstream body;
+  if (json)
+  {
+    body << "{\n"
+         << "  \"uptime\": " << (now - server_stats.start_up_time) << ",\n"
+         << "  \"connections\": " << instances << ",\n"
+         << "  \"states\": {";
+    for (unsigned int i = 0; i <= TERMINATE; ++i)
+      body << (i ? ", " : " ") << "\"" << state_names[i] << "\": " << connections_in_state[i];
+    body << " },\n"
+         << "  \"requests\": " << server_stats.requests << ",\n"
+         << "  \"bytes_sent\": " << server_stats.bytes_sent << ",\n"
+         << "  \"status_codes\": {";
+    for (map<unsigned int, uint64_t>::const_iterator i = server_stats.status_codes.begin();
+         i != server_stats.status_codes.end(); ++i)
+      body << (i == server_stats.status_codes.begin() ? " " : ", ")
+           << "\"" << i->first << "\": " << i->second;
+    body << " },\n"
+         << "  \"variant_cache\": { \"size\": " << compressed_variants.size()
+         << ", \"hits\": " << compressed_variants.hits()
+         << ", \"misses\": " << compressed_variants.misses() << " },\n"
+         << "  \"peer_limits\": { \"rejected_connections\": " << peers.rejected_connections()
+         << ", \"rejected_requests\": " << peers.rejected_requests()
+         << ", \"untracked\": " << peers.untracked() << " },\n"
+         << "  \"time_to_first_byte\": ";
+    print_histogram_json(body, server_stats.time_to_first_byte);
+    body << ",\n"
+         << "  \"request_time\": ";
+    print_histogram_json(body, server_stats.request_time);
+    body << ",\n"
+         << "  \"time_in_state\": {";
+    for (unsigned int i = 0; i < TERMINATE; ++i)
+    {
+      body << (i ? "," : "") << "\n    \"" << state_names[i] << "\": ";
+      print_histogram_json(body, state_histograms[i]);
+    }
+    body << "\n  }\n}\n";
+  }
+  else
+  {
+    body << "uptime: " << (now - server_stats.start_up_time) << "\n"
+         << "connections: " << instances << "\n";
+    for (unsigned int i = 0; i <= TERMINATE; ++i)
+      body << "  " << state_names[i] << ": " << connections_in_state[i] << "\n";
+    body << "requests: " << server_stats.requests << "\n"
+         << "bytes-sent: " << server_stats.bytes_sent << "\n"
+         << "status-codes:\n";
+    for (map<unsigned int, uint64_t>::const_iterator i = server_stats.status_codes.begin();
+         i != server_stats.status_codes.end(); ++i)
+      body << "  " << i->first << ": " << i->second << "\n";
+    body << "variant-cache: size=" << compressed_variants.size()
+         << " hits=" << compressed_variants.hits()
+         << " misses=" << compressed_variants.misses() << "\n"
+         << "peer-limits: rejected-connections=" << peers.rejected_connections()
+         << " rejected-requests=" << peers.rejected_requests()
+         << " untracked=" << peers.untracked() << "\n";
+    print_histogram(body, "time-to-first-byte", server_stats.time_to_first_byte);
+    print_histogram(body, "request-time", server_stats.request_time);
+    for (unsigned int i = 0; i < TERMINATE; ++i)
+      print_histogram(body, (string("time-in-") + state_names[i]).c_str(), state_histograms[i]);
+  }
+  memory_body_owner.reset(new string(body.str()));
+
+  decide_persistence();
+
+  ostringstream buf;
+  buf << "HTTP/1.1 200 OK\r\n";
+  if (!config->server_string.empty())
+    buf << "Server: " << config->server_string << "\r\n";
+  buf << "Date: " << time_to_rfcdate(now) << "\r\n"
+      << "Content-Type: " << (json ? "application/json" : "text/plain") << "\r\n"
+      << "Content-Length: " << memory_body_owner->size() << "\r\n"
+      << "Cache-Control: no-cache\r\n";
+  if (!request.connection.empty())
+  {
+    if (use_persistent_connection)
+    {
+      buf << "Connection: keep-alive\r\n"
+      << "Keep-Alive: timeout=" << config->network_read_timeout << ", max=100\r\n";
+    }
+    else
+    {
+      buf << "Connection: close\r\n";
+    }
+  }
+  buf << "\r\n";
+  write_buffer       += buf.str();
+  request.status_code = 200;
+  request.object_size = memory_body_owner->size();
+
+  if (request.method == "HEAD")
+  {
+    memory_body_owner.reset();
+    set_state(FLUSH_BUFFER);
+  }
+  else
+  {
+    memory_body     = memory_body_owner->data();
+    memory_body_end = memory_body + memory_body_owner->size();
+    set_state(COPY_FILE);
+  }
+  go_to_write_mode();
+}
@@ -20,15 +20,22 @@
 #include <climits>
 #include <cctype>
 #include <cstdlib>
+#include <cstdio>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "system-error.hh"
 #include "HTTPParser.hh"
 #include "RequestHandler.hh"
 #include "timestamp-to-string.hh"
 #include "escape-html-specials.hh"
 #include "urldecode.hh"
+#include "gzip-encoder.hh"
+#include "variant-cache.hh"
+#include "pack-file.hh"
+#include "warmup.hh"
 #include "config.hh"
 #include "log.hh"
 
@@ -61,12 +68,100 @@ static inline bool is_path_in_hierarchy(const char* hierarchy, const char* path)
   return true;
 }
 
+/*
+  Turn the byte ranges of a Range header into absolute positions in a
+  file of the given size, so that first and last are set for every
+  range afterwards. Ranges starting beyond the end of the file are
+  dropped. If no range remains, the request can't be satisfied.
+*/
+
+static bool resolve_byte_ranges(vector<ByteRange>& ranges, off_t size)
+{
+  vector<ByteRange> resolved;
+  for (vector<ByteRange>::const_iterator i = ranges.begin(); i != ranges.end(); ++i)
+  {
+    ByteRange range;
+    if (i->first.empty())
+    {
+      if (i->last == 0)
+        continue;
+      range.first = (i->last < size) ? size - i->last : 0;
+      range.last  = size - 1;
+    }
+    else
+    {
+      if (i->first >= size)
+        continue;
+      range.first = i->first;
+      range.last  = (i->last.empty() || i->last >= size) ? size - 1 : i->last.data();
+    }
+    resolved.push_back(range);
+  }
+  ranges.swap(resolved);
+  return !ranges.empty();
+}
+
+// Requests asking for more ranges than this get the whole file; it's
+// cheaper for everybody.
+
+static const size_t max_byte_ranges = 16;
+
+static unsigned int boundary_counter = 0;
+
+// The pre-compressed variants of a file we look for, in order of
+// preference.
+
+static const struct
+{
+  unsigned int coding;
+  const char*  name;
+  const char*  suffix;
+}
+precompressed_variants[] =
+{
+  { CODING_BR,   "br",   ".br"  },
+  { CODING_ZSTD, "zstd", ".zst" },
+  { CODING_GZIP, "gzip", ".gz"  }
+};
+
+/*
+  Our entity tags are derived from the file's inode number, size, and
+  modification time -- with nanosecond resolution where the system
+  provides it. That's enough to tell versions of a file apart without
+  reading it. Replies we compress on the fly get the coding appended,
+  because they are a different representation of the same file.
+*/
+
+static string make_entity_tag(const struct stat& st, const char* coding)
+{
+  unsigned long nsec = 0;
+#if defined(HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+  nsec = st.st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+  nsec = st.st_mtimespec.tv_nsec;
+#endif
+  char buf[128];
+  snprintf(buf, sizeof(buf), "\"%lx-%llx-%lx.%lx%s%s\"",
+           static_cast<unsigned long>(st.st_ino), static_cast<unsigned long long>(st.st_size),
+           static_cast<unsigned long>(st.st_mtime), nsec,
+           (coding ? "-" : ""), (coding ? coding : ""));
+  return buf;
+}
+
 bool RequestHandler::setup_reply()
 {
   TRACE();
 
-  // Now that we have the whole request, we can get to work. Let's
-  // start by testing whether we understand the request at all.
+  // Now that we have the whole request, we can get to work -- unless
+  // the peer is sending requests faster than we accept them.
+
+  if (!peers.charge_request(peer))
+  {
+    too_many_requests();
+    return false;
+  }
+
+  // Let's start by testing whether we understand the request at all.
 
   if (request.method != "GET" && request.method != "HEAD")
   {
@@ -105,11 +200,34 @@ bool RequestHandler::setup_reply()
       request.port = request.url.port;
   }
 
+  // The status page is answered by the server itself: on the virtual
+  // host given with --status-host, or else to local peers only.
+
+  if (!config->status_url.empty() && request.url.path == config->status_url &&
+      (config->status_host.empty() ? peer_is_local : request.host == config->status_host))
+  {
+    server_status();
+    return true;
+  }
+
   // Construct the actual file name associated with the hostname and
   // URL, then check whether we can send that file.
 
+  char path[PATH_MAX];
+  size_t path_len = urldecode_path(request.url.path.data(), request.url.path.size(), path, sizeof(path));
+  if (path_len == 0)
+  {
+    info("Peer %s requested URL 'http://%s:%u%s', which cannot be mapped to a file.",
+         peer_address, request.host.c_str(), ((request.port.empty()) ? 80 : request.port.data()),
+         request.url.path.c_str());
+    file_not_found();
+    return false;
+  }
+  if (document_pack.is_open())
+    return setup_packed_reply(path, path_len);
+
   document_root = config->document_root + "/" + request.host;
-  filename = document_root + urldecode(request.url.path);
+  filename.assign(document_root).append(path, path_len);
 
   if (!is_path_in_hierarchy(document_root.c_str(), filename.c_str()))
   {
@@ -138,7 +256,7 @@ stat_again:
 
   if (S_ISDIR(file_stat.st_mode))
   {
-    if (*request.url.path.rbegin() == '/')
+    if (path[path_len - 1] == '/')
     {
       filename += config->default_page;
       goto stat_again;    // What the fuck does Nikolas Wirth know?
@@ -150,36 +268,174 @@ stat_again:
     }
   }
 
-  // Decide whether to use a persistent connection.
+  // The content type is determined by the file the peer asked for,
+  // not by a pre-compressed variant we may send instead.
+
+  content_type = config->get_content_type(filename.c_str());
 
-  use_persistent_connection = HTTPParser::supports_persistent_connection(request);
+  // Remember the file for warming the caches after a restart.
 
-  // Check whether the If-Modified-Since header applies.
+  if (!config->warm_manifest.empty())
+    warmer.touch(filename.substr(config->document_root.size() + 1));
 
-  if (!request.if_modified_since.empty())
+  // If the peer accepts a coding we have a pre-compressed variant of
+  // the file for, send that variant instead. It must be a regular file
+  // next to the original and at least as new; a stale variant would
+  // serve outdated content. We don't follow symlinks here, because the
+  // variant didn't go through the hierarchy check.
+
+  if (config->precompressed && !request.accept_encoding.empty())
+  {
+    for (size_t i = 0; i < sizeof(precompressed_variants) / sizeof(precompressed_variants[0]); ++i)
+    {
+      if ((request.accept_encoding & precompressed_variants[i].coding) == 0)
+        continue;
+      string variant = filename + precompressed_variants[i].suffix;
+      struct stat variant_stat;
+      if (lstat(variant.c_str(), &variant_stat) == 0 && S_ISREG(variant_stat.st_mode) &&
+          variant_stat.st_mtime >= file_stat.st_mtime)
+      {
+        debug(("%d: Sending pre-compressed variant '%s'.", sockfd, variant.c_str()));
+        filename.swap(variant);
+        file_stat        = variant_stat;
+        content_encoding = precompressed_variants[i].name;
+        break;
+      }
+    }
+  }
+
+  // Otherwise, we may compress text on the fly. Range requests
+  // always get the plain file, and so do tiny files, which wouldn't
+  // shrink much anyway. If we have compressed the file before, the
+  // result is waiting in the variant cache.
+
+  bool compress_on_the_fly = false;
+  vary_on_encoding = config->precompressed;
+#ifdef HAVE_LIBZ
+  if (config->compress && content_encoding.empty() && config->is_compressible(content_type))
+  {
+    vary_on_encoding = true;
+    if (!request.accept_encoding.empty() && (request.accept_encoding & CODING_GZIP) &&
+        request.ranges.empty() && file_stat.st_size >= min_compressible_size)
+    {
+      compress_on_the_fly = true;
+      content_encoding    = "gzip";
+      memory_body_owner   = compressed_variants.find(filename, file_stat, CODING_GZIP);
+      cache_status        = memory_body_owner ? "HIT" : "MISS";
+      debug(("%d: Compressing '%s' on the fly (%s).", sockfd, filename.c_str(),
+             (memory_body_owner ? "cached" : "not cached")));
+    }
+  }
+#endif
+
+  decide_persistence();
+
+  // Check whether the conditional headers apply. If-None-Match takes
+  // precedence over If-Modified-Since.
+
+  etag = make_entity_tag(file_stat, (compress_on_the_fly ? content_encoding.c_str() : 0));
+  if (!request.if_none_match.empty())
+  {
+    if (HTTPParser::if_none_match_applies(request, etag))
+    {
+      debug(("%d: Requested file ('%s') has entity tag %s, which matches If-None-Match: Not modified.",
+             sockfd, filename.c_str(), etag.c_str()));
+      memory_body_owner.reset();
+      not_modified();
+      return true;
+    }
+  }
+  else if (!request.if_modified_since.empty())
   {
     if (file_stat.st_mtime <= request.if_modified_since)
     {
       debug(("%d: Requested file ('%s') has mtime '%d' and if-modified-since was '%d: Not modified.",
              sockfd, filename.c_str(), file_stat.st_mtime, request.if_modified_since.data()));
+      memory_body_owner.reset();
       not_modified();
-      return false;
+      return true;
     }
     else
       debug(("%d: Requested file ('%s') has mtime '%d' and if-modified-since was '%d: Modified.",
              sockfd, filename.c_str(), file_stat.st_mtime, request.if_modified_since.data()));
   }
 
-  // Now answer the request, which may be either HEAD or GET.
+  // Figure out whether the peer wants only parts of the file. Range
+  // applies to GET requests only, and if the request carries an
+  // If-Range validator -- an entity tag or a date --, that validator
+  // must still match the file exactly.
+
+  string last_modified = time_to_rfcdate(file_stat.st_mtime);
+  if (!request.ranges.empty())
+  {
+    if (request.method != "GET" || request.ranges.size() > max_byte_ranges ||
+        (!request.if_range.empty() && request.if_range != etag && request.if_range != last_modified))
+    {
+      debug(("%d: Ignoring Range header; sending the complete file.", sockfd));
+      request.ranges.clear();
+    }
+    else if (!resolve_byte_ranges(request.ranges, file_stat.st_size))
+    {
+      range_not_satisfiable();
+      return false;
+    }
+  }
+
+  // Now answer the request, which may be either HEAD or GET. We don't
+  // know the length of a reply we're compressing on the fly: HTTP/1.1
+  // peers get it in chunked encoding, others have to wait for us to
+  // close the connection.
+
+  bool unknown_length = compress_on_the_fly && !memory_body_owner;
+  chunked = unknown_length &&
+            (request.major_version > 1 || (request.major_version == 1 && request.minor_version >= 1));
+  if (unknown_length && !chunked)
+    use_persistent_connection = false;
 
+  off_t content_length = memory_body_owner ? memory_body_owner->size() : file_stat.st_size;
   ostringstream buf;
-  buf << "HTTP/1.1 200 OK\r\n";
+  if (request.ranges.empty())
+    buf << "HTTP/1.1 200 OK\r\n";
+  else
+    buf << "HTTP/1.1 206 Partial Content\r\n";
   if (!config->server_string.empty())
     buf << "Server: " << config->server_string << "\r\n";
-  buf << "Date: " << time_to_rfcdate(time(0)) << "\r\n"
-  << "Content-Type: " << config->get_content_type(filename.c_str()) << "\r\n"
-  << "Content-Length: " << file_stat.st_size << "\r\n"
-  << "Last-Modified: " << time_to_rfcdate(file_stat.st_mtime) << "\r\n";
+  buf << "Date: " << time_to_rfcdate(time(0)) << "\r\n";
+  if (request.ranges.size() > 1)
+  {
+    char boundary[32];
+    snprintf(boundary, sizeof(boundary), "%08lx%08x",
+             static_cast<unsigned long>(request.start_up_time), ++boundary_counter);
+    multipart_boundary = boundary;
+    content_length = 0;
+    for (vector<ByteRange>::const_iterator i = request.ranges.begin(); i != request.ranges.end(); ++i)
+      content_length += byterange_part_header(*i).size() + (i->last - i->first + 1);
+    content_length += multipart_boundary.size() + 8; // "\r\n--" boundary "--\r\n"
+    buf << "Content-Type: multipart/byteranges; boundary=" << multipart_boundary << "\r\n";
+  }
+  else
+  {
+    buf << "Content-Type: " << content_type << "\r\n";
+    if (!request.ranges.empty())
+    {
+      const ByteRange& range = request.ranges.front();
+      content_length = range.last - range.first + 1;
+      buf << "Content-Range: bytes " << range.first << "-" << range.last
+          << "/" << file_stat.st_size << "\r\n";
+    }
+  }
+  if (!content_encoding.empty())
+    buf << "Content-Encoding: " << content_encoding << "\r\n";
+  if (vary_on_encoding)
+    buf << "Vary: Accept-Encoding\r\n";
+  if (chunked)
+    buf << "Transfer-Encoding: chunked\r\n";
+  else if (!unknown_length)
+    buf << "Content-Length: " << content_length << "\r\n";
+  buf << "Last-Modified: " << last_modified << "\r\n"
+  << "ETag: " << etag << "\r\n";
+  if (!compress_on_the_fly)
+    buf << "Accept-Ranges: bytes\r\n";
   if (!request.connection.empty())
   {
     if (use_persistent_connection)
@@ -193,15 +449,32 @@ stat_again:
     }
   }
   buf << "\r\n";
-  write_buffer        = buf.str();
-  request.status_code = 200;
-  request.object_size = file_stat.st_size;
+  write_buffer       += buf.str();
+  request.status_code = request.ranges.empty() ? 200 : 206;
+  if (!unknown_length)
+    request.object_size = content_length;
 
   if (request.method == "HEAD")
   {
-    state = FLUSH_BUFFER;
+    set_state(FLUSH_BUFFER);
+    memory_body_owner.reset();
     debug(("%d: Answering HEAD; going into FLUSH_BUFFER state.", sockfd));
   }
+  else if (memory_body_owner && memory_body_owner->size() <= config->small_file_threshold)
+  {
+    write_buffer += *memory_body_owner;
+    memory_body_owner.reset();
+    set_state(FLUSH_BUFFER);
+    debug(("%d: Answering GET from memory in one piece; going into FLUSH_BUFFER state.", sockfd));
+  }
+  else if (memory_body_owner)
+  {
+    cork();
+    memory_body     = memory_body_owner->data();
+    memory_body_end = memory_body + memory_body_owner->size();
+    set_state(COPY_FILE);
+    debug(("%d: Answering GET from memory; going into COPY_FILE state.", sockfd));
+  }
   else // must be GET
   {
     filefd = open(filename.c_str(), O_RDONLY, 0);
@@ -211,10 +484,108 @@ stat_again:
       file_not_found();
       return false;
     }
-    state = COPY_FILE;
+
+    // Small files are read right away and sent along with the header.
+
+    if (!unknown_length && request.ranges.empty() && file_stat.st_size <= config->small_file_threshold)
+    {
+      size_t header_size = write_buffer.size();
+      write_buffer.resize(header_size + file_stat.st_size);
+      ssize_t rc = pread(filefd, &write_buffer[header_size], file_stat.st_size, 0);
+      if (rc < 0)
+        throw system_error(string("pread() from file '") + filename + "' failed");
+      if (rc < file_stat.st_size)
+      {
+        info("File '%s' shrunk while it was being sent to %s.", filename.c_str(), peer_address);
+        write_buffer.resize(header_size + rc);
+      }
+      close(filefd);
+      filefd = -1;
+      set_state(FLUSH_BUFFER);
+      debug(("%d: Answering GET in one piece; going into FLUSH_BUFFER state.", sockfd));
+      return send_immediately();
+    }
+
+    // With byte ranges, copy_file() starts each range on its own, so
+    // we begin with an empty segment.
+
+    next_range   = 0;
+    file_offset  = 0;
+    file_end     = request.ranges.empty() ? file_stat.st_size : 0;
+    prepare_copy_file();
+#ifdef HAVE_LIBZ
+    if (unknown_length)
+    {
+      encoder.reset(new gzip_encoder);
+      encoded_size = 0;
+      if (file_stat.st_size <= static_cast<off_t>(compressed_variants.capacity() / 8))
+        compressed_copy.reset(new string);
+    }
+#endif
+    cork();
+    set_state(COPY_FILE);
     debug(("%d: Answering GET; going into COPY_FILE state.", sockfd));
   }
 
+  if (state == FLUSH_BUFFER)
+    return send_immediately();
   go_to_write_mode();
-  return false;
+  return true;
+}
+
+/*
+   Decide whether to use a persistent connection -- never while we're
+   draining, because the server is about to exit. On a persistent
+   connection, no FIN pushes out the last partial frame of a reply, so
+   we switch Nagle's algorithm off for good. Replies that are written
+   in several pieces are corked, so this doesn't cost us extra packets.
+*/
+
+void RequestHandler::decide_persistence()
+{
+  use_persistent_connection = !draining && HTTPParser::supports_persistent_connection(request);
+  if (use_persistent_connection && !nodelay)
+  {
+    int true_flag = 1;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &true_flag, sizeof(int)) == -1)
+      debug(("%d: Cannot set TCP_NODELAY: %s", sockfd, strerror(errno)));
+    nodelay = true;
+  }
+}
+
+/*
+   When the complete reply is in the write_buffer, we write it right
+   away instead of waiting for the scheduler to tell us that the
+   socket is writable -- it almost always is. Small replies are thus
+   done within the callback that read the request. If the peer has
+   pipelined another request, we leave the reply in the buffer, so
+   that it goes out together with the next one. Errors are left for
+   fd_is_writable() to find.
+*/
+
+bool RequestHandler::send_immediately()
+{
+  if (!HTTPParser::have_complete_request(read_buffer))
+  {
+    ssize_t rc = write(sockfd, write_buffer.data(), write_buffer.size());
+    if (rc > 0)
+    {
+      write_buffer.erase(0, rc);
+      bytes_written(rc);
+    }
+  }
+  if (!write_buffer.empty() || !use_persistent_connection)
+    go_to_write_mode();
+  return true;
+}
+
+string RequestHandler::byterange_part_header(const ByteRange& range) const
+{
+  ostringstream buf;
+  buf << "\r\n--" << multipart_boundary << "\r\n"
+  << "Content-Type: " << content_type << "\r\n"
+  << "Content-Range: bytes " << range.first << "-" << range.last
+  << "/" << file_stat.st_size << "\r\n"
+  << "\r\n";
+  return buf.str();
 }
@@ -52,11 +52,11 @@ void RequestHandler::protocol_error(const string& message)
   << "</blockquote>\r\n"
   << "</body>\r\n"
   << "</html>\r\n";
-  write_buffer = buf.str();
+  write_buffer += buf.str();
   request.status_code = 400;
   request.object_size = 0;
   use_persistent_connection = false;
-  state = FLUSH_BUFFER;
+  set_state(FLUSH_BUFFER);
   go_to_write_mode();
 }
 
@@ -85,11 +85,11 @@ void RequestHandler::file_not_found()
   << "</tt> does not exist on this server.</p>\r\n"
   << "</body>\r\n"
   << "</html>\r\n";
-  write_buffer = buf.str();
+  write_buffer += buf.str();
   request.status_code = 404;
   request.object_size = 0;
   use_persistent_connection = false;
-  state = FLUSH_BUFFER;
+  set_state(FLUSH_BUFFER);
   go_to_write_mode();
 }
 
@@ -124,11 +124,11 @@ void RequestHandler::moved_permanently(const string& path)
   buf << path << "\">here</a>.\r\n"
   << "</body>\r\n"
   << "</html>\r\n";
-  write_buffer        = buf.str();
+  write_buffer       += buf.str();
   request.status_code = 301;
   request.object_size = 0;
   use_persistent_connection = false;
-  state = FLUSH_BUFFER;
+  set_state(FLUSH_BUFFER);
   go_to_write_mode();
 }
 
@@ -142,6 +142,10 @@ void RequestHandler::not_modified()
   if (!config->server_string.empty())
     buf << "Server: " << config->server_string << "\r\n";
   buf << "Date: " << time_to_rfcdate(time(0)) << "\r\n";
+  if (!etag.empty())
+    buf << "ETag: " << etag << "\r\n";
+  if (vary_on_encoding)
+    buf << "Vary: Accept-Encoding\r\n";
   if (!request.connection.empty())
   {
     if (use_persistent_connection)
@@ -155,8 +159,76 @@ void RequestHandler::not_modified()
     }
   }
   buf << "\r\n";
-  write_buffer = buf.str();
+  write_buffer += buf.str();
   request.status_code = 304;
-  state = FLUSH_BUFFER;
+  set_state(FLUSH_BUFFER);
+  go_to_write_mode();
+}
+
+void RequestHandler::range_not_satisfiable()
+{
+  TRACE();
+  debug(("%d: No requested range of '%s' lies within the file; going into FLUSH_BUFFER state.",
+         sockfd, request.url.path.c_str()));
+
+  ostringstream buf;
+  buf << "HTTP/1.1 416 Requested Range Not Satisfiable\r\n";
+  if (!config->server_string.empty())
+    buf << "Server: " << config->server_string << "\r\n";
+  buf << "Date: " << time_to_rfcdate(time(0)) << "\r\n"
+  << "Content-Type: text/html\r\n"
+  << "Content-Range: bytes */" << file_stat.st_size << "\r\n";
+  if (!request.connection.empty())
+    buf << "Connection: close\r\n";
+  buf << "\r\n"
+  << "<html>\r\n"
+  << "<head>\r\n"
+  << "  <title>Requested Range Not Satisfiable</title>\r\n"
+  << "</head>\r\n"
+  << "<body>\r\n"
+  << "<h1>Requested Range Not Satisfiable</h1>\r\n"
+  << "<p>None of the byte ranges requested for <tt>"
+  << escape_html_specials(request.url.path)
+  << "</tt> lies within the document.</p>\r\n"
+  << "</body>\r\n"
+  << "</html>\r\n";
+  write_buffer += buf.str();
+  request.status_code = 416;
+  request.object_size = 0;
+  use_persistent_connection = false;
+  set_state(FLUSH_BUFFER);
+  go_to_write_mode();
+}
+
+void RequestHandler::too_many_requests()
+{
+  TRACE();
+  debug(("%d: Peer %s has exceeded its request rate; going into FLUSH_BUFFER state.", sockfd, peer_address));
+
+  ostringstream buf;
+  buf << "HTTP/1.1 429 Too Many Requests\r\n";
+  if (!config->server_string.empty())
+    buf << "Server: " << config->server_string << "\r\n";
+  buf << "Date: " << time_to_rfcdate(time(0)) << "\r\n"
+  << "Content-Type: text/html\r\n"
+  << "Retry-After: 1\r\n";
+  if (!request.connection.empty())
+    buf << "Connection: close\r\n";
+  buf << "\r\n"
+  << "<html>\r\n"
+  << "<head>\r\n"
+  << "  <title>Too Many Requests</title>\r\n"
+  << "</head>\r\n"
+  << "<body>\r\n"
+  << "<h1>Too Many Requests</h1>\r\n"
+  << "<p>You have sent more requests than this server accepts from a single\r\n"
+  << "address. Please try again later.</p>\r\n"
+  << "</body>\r\n"
+  << "</html>\r\n";
+  write_buffer += buf.str();
+  request.status_code = 429;
+  request.object_size = 0;
+  use_persistent_connection = false;
+  set_state(FLUSH_BUFFER);
   go_to_write_mode();
 }
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include "statistics.hh"
+
+using namespace std;
+
+log_histogram::log_histogram() : total(0)
+{
+  for (unsigned int i = 0; i < buckets; ++i)
+    counts[i] = 0;
+}
+
+void log_histogram::add(uint64_t value)
+{
+  unsigned int n = 0;
+  while (value > 1 && n < buckets - 1)
+  {
+    value >>= 1;
+    ++n;
+  }
+  ++counts[n];
+  ++total;
+}
+
+uint64_t log_histogram::percentile(double p) const
+{
+  if (total == 0)
+    return 0;
+  uint64_t rank = static_cast<uint64_t>(total * p / 100.0 + 0.5);
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  for (unsigned int n = 0; n < buckets; ++n)
+  {
+    seen += counts[n];
+    if (seen >= rank)
+      return (static_cast<uint64_t>(1) << (n + 1)) - 1;
+  }
+  return (static_cast<uint64_t>(1) << buckets) - 1;
+}
+
+server_statistics::server_statistics()
+    : start_up_time(time(0)), requests(0), bytes_sent(0)
+{
+}
+
+void server_statistics::request_completed(unsigned int status_code,
+                                          uint64_t first_byte, uint64_t total_time)
+{
+  ++requests;
+  ++status_codes[status_code];
+  time_to_first_byte.add(first_byte);
+  request_time.add(total_time);
+}
+
+// The global statistics.
+
+server_statistics server_stats;
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATISTICS_HH_INCLUDED
+#define STATISTICS_HH_INCLUDED
+
+#include <map>
+#include <ctime>
+#include <stdint.h>
+
+// Microseconds on the monotonic clock. Only the difference between two
+// of these values means anything.
+
+inline uint64_t monotonic_usec()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// The same with less precision -- typically the resolution of the
+// timer tick -- but without the cost of reading the hardware clock.
+
+inline uint64_t monotonic_coarse_usec()
+{
+  timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// A histogram with logarithmic buckets: bucket n counts the values in
+// [2^n, 2^(n+1)), the first bucket counts zero as well, and the last
+// one everything that's too large for the others. Adding a value costs
+// a few instructions, no matter how many values there are.
+
+class log_histogram
+{
+public:
+  enum { buckets = 32 };
+
+  log_histogram();
+
+  void add(uint64_t value);
+
+  uint64_t count() const                { return total; }
+  uint64_t bucket(unsigned int n) const { return counts[n]; }
+
+  // The upper bound of the bucket holding the given percentile, which
+  // is a number between 0 and 100.
+
+  uint64_t percentile(double p) const;
+
+private:
+  uint64_t counts[buckets];
+  uint64_t total;
+};
+
+// The server-wide counters. Latencies are measured in microseconds.
+
+struct server_statistics
+{
+  server_statistics();
+
+  void request_completed(unsigned int status_code, uint64_t time_to_first_byte, uint64_t total_time);
+
+  time_t                             start_up_time;
+  uint64_t                           requests;
+  uint64_t                           bytes_sent;
+  std::map<unsigned int, uint64_t>   status_codes;
+  log_histogram                      time_to_first_byte;
+  log_histogram                      request_time;
+};
+
+extern server_statistics server_stats;
+
+#endif // STATISTICS_HH_INCLUDED
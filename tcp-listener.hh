@@ -19,22 +19,49 @@
 #define TCP_LISTENER_HH_INCLUDED
 
 #include <stdexcept>
+#include <string>
 #include <cstdio>
+#include <cstring>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include "system-error.hh"
 #include "libscheduler/scheduler.hh"
+#include "peer-table.hh"
 #include "log.hh"
 
+/*
+  The listener accepts new connections and creates a
+  connection_handlerT for each of them. If defer_accept is non-zero,
+  the kernel holds back connections until the peer has sent data or
+  that many seconds have passed, so that we don't wake up for idle
+  connections. A non-zero fastopen sets the queue length for TCP Fast
+  Open, which lets clients send their request along with the SYN.
+
+  Despite its name, the listener serves IPv4, IPv6, and Unix domain
+  stream sockets alike; the handler gets the peer's address as a
+  generic sockaddr. Neither of the TCP options applies to a Unix
+  domain socket.
+
+  Connections from peers that have reached their limits in the peer
+  table are closed right away, before any resources are spent on
+  them. If the peer table counted the connection, the handler has to
+  release() its peer when it's done.
+*/
+
 template<class connection_handlerT>
 class TCPListener : public scheduler::event_handler
 {
 public:
-  explicit TCPListener(scheduler& sched, short port_no, int queue_backlog = 50)
-      : mysched(sched)
+  explicit TCPListener(scheduler& sched, short port_no, int queue_backlog = 50,
+                       int defer_accept = 0, int fastopen = 0)
+      : mysched(sched), family(AF_INET)
   {
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd == -1)
@@ -48,20 +75,64 @@ public:
       if (fcntl(sockfd, F_SETFL, O_NONBLOCK) == -1)
         throw system_error("cannot set listen socket to non-blocking mode");
 
+      sockaddr_in sin;
+      memset(&sin, 0, sizeof(sin));
       sin.sin_family      = AF_INET;
       sin.sin_addr.s_addr = htonl(INADDR_ANY);
       sin.sin_port        = htons(port_no);
-      sin_size            = sizeof(sin);
-      if (bind(sockfd, (sockaddr*)&sin, sin_size) == -1)
+      if (bind(sockfd, (sockaddr*)&sin, sizeof(sin)) == -1)
         throw system_error("bind() failed");
+      describe((sockaddr&)sin);
+
+      set_socket_options(defer_accept, fastopen);
+
+      if (listen(sockfd, queue_backlog) == -1)
+        throw system_error("listen() failed");
+
+      register_socket();
+    }
+    catch (...)
+    {
+      close(sockfd);
+      throw;
+    }
+  }
+
+  // Listen on a Unix domain socket at the given path. A socket left
+  // there by an earlier run is replaced; anything else is not. The
+  // file stays when we're done, because a server that has taken over
+  // from us may still be accepting on it.
+
+  explicit TCPListener(scheduler& sched, const std::string& path, int queue_backlog = 50)
+      : mysched(sched), family(AF_UNIX)
+  {
+    sockaddr_un sa_un;
+    memset(&sa_un, 0, sizeof(sa_un));
+    if (path.empty() || path.size() >= sizeof(sa_un.sun_path))
+      throw std::invalid_argument("Unix domain socket path '" + path + "' is empty or too long");
+    sa_un.sun_family = AF_UNIX;
+    memcpy(sa_un.sun_path, path.data(), path.size());
+
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode) && unlink(path.c_str()) == -1)
+      throw system_error("cannot remove stale socket '" + path + "'");
+
+    sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1)
+      throw system_error("socket() failed");
+    try
+    {
+      if (fcntl(sockfd, F_SETFL, O_NONBLOCK) == -1)
+        throw system_error("cannot set listen socket to non-blocking mode");
+
+      if (bind(sockfd, (sockaddr*)&sa_un, sizeof(sa_un)) == -1)
+        throw system_error("cannot bind to '" + path + "'");
+      describe((sockaddr&)sa_un);
 
       if (listen(sockfd, queue_backlog) == -1)
         throw system_error("listen() failed");
 
-      scheduler::handler_properties prop;
-      prop.poll_events  = POLLIN;
-      prop.read_timeout = 0;
-      mysched.register_handler(sockfd, *this, prop);
+      register_socket();
     }
     catch (...)
     {
@@ -70,33 +141,164 @@ public:
     }
   }
 
+  // Take over a socket that's listening already: one inherited from
+  // the server we're replacing, or from the service manager that
+  // started us. The socket stays open if we fail to use it.
+
+  explicit TCPListener(scheduler& sched, int listen_fd, int defer_accept, int fastopen)
+      : mysched(sched), sockfd(listen_fd)
+  {
+    int type;
+    socklen_t len = sizeof(type);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &len) == -1)
+      throw system_error("cannot use inherited listen socket");
+    if (type != SOCK_STREAM)
+      throw std::invalid_argument("inherited listen socket is not a stream socket");
+#ifdef SO_ACCEPTCONN
+    int listening;
+    len = sizeof(listening);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == -1)
+      throw system_error("cannot use inherited listen socket");
+    if (!listening)
+      throw std::invalid_argument("inherited socket is not listening");
+#endif
+    sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    len = sizeof(addr);
+    if (getsockname(sockfd, (sockaddr*)&addr, &len) == -1)
+      throw system_error("cannot use inherited listen socket");
+    family = addr.ss_family;
+    if (family != AF_INET && family != AF_INET6 && family != AF_UNIX)
+      throw std::invalid_argument("inherited listen socket is of an unsupported address family");
+    describe((sockaddr&)addr);
+
+    if (fcntl(sockfd, F_SETFL, O_NONBLOCK) == -1)
+      throw system_error("cannot set listen socket to non-blocking mode");
+    set_socket_options(defer_accept, fastopen);
+
+    register_socket();
+  }
+
   virtual ~TCPListener()
   {
-    mysched.remove_handler(sockfd);
-    close(sockfd);
+    stop();
+  }
+
+  int fd() const                { return sockfd; }
+
+  // Where we're listening, in human-readable form.
+
+  const std::string& address() const { return description; }
+
+  // Stop accepting connections. Whatever is waiting in the queue is
+  // left to other processes that have the socket open.
+
+  void stop()
+  {
+    if (sockfd >= 0)
+    {
+      mysched.remove_handler(sockfd);
+      close(sockfd);
+      sockfd = -1;
+    }
   }
 
 private:
+  void register_socket()
+  {
+    scheduler::handler_properties prop;
+    prop.poll_events  = POLLIN;
+    prop.read_timeout = 0;
+    mysched.register_handler(sockfd, *this, prop);
+  }
+
+  void describe(const sockaddr& addr)
+  {
+    if (addr.sa_family == AF_UNIX)
+    {
+      description = reinterpret_cast<const sockaddr_un&>(addr).sun_path;
+      return;
+    }
+    char host[64];
+    format_peer_address(addr, host, sizeof(host));
+    unsigned int port = (addr.sa_family == AF_INET)
+                      ? ntohs(reinterpret_cast<const sockaddr_in&>(addr).sin_port)
+                      : ntohs(reinterpret_cast<const sockaddr_in6&>(addr).sin6_port);
+    char buf[96];
+    snprintf(buf, sizeof(buf), (addr.sa_family == AF_INET6 ? "[%s]:%u" : "%s:%u"), host, port);
+    description = buf;
+  }
+
+  void set_socket_options(int defer_accept, int fastopen)
+  {
+    if (family == AF_UNIX)
+      return;
+
+    if (defer_accept > 0)
+    {
+#ifdef TCP_DEFER_ACCEPT
+      if (setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof(int)) == -1)
+        throw system_error("cannot set listen socket to DEFER_ACCEPT mode");
+#else
+      error("TCPListener: TCP_DEFER_ACCEPT is not supported on this system; ignoring it");
+#endif
+    }
+
+    if (fastopen > 0)
+    {
+#ifdef TCP_FASTOPEN
+      if (setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(int)) == -1)
+        throw system_error("cannot enable FASTOPEN on listen socket");
+#else
+      error("TCPListener: TCP_FASTOPEN is not supported on this system; ignoring it");
+#endif
+    }
+  }
+
+  // The peer address of a Unix domain connection may come back empty,
+  // so we fill in the address family beforehand.
+
   virtual void fd_is_readable(int)
   {
-    int streamfd = accept(sockfd, (sockaddr*) & sin, &sin_size);
+    sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.ss_family     = family;
+    socklen_t addr_size = sizeof(addr);
+    int streamfd = accept(sockfd, (sockaddr*)&addr, &addr_size);
     if (streamfd == -1)
     {
       error("TCPListener: failed to accept() new connection: %s", strerror(errno));
       return;
     }
+    const sockaddr& peer_addr = reinterpret_cast<const sockaddr&>(addr);
+    peer_key peer = make_peer_key(peer_addr);
+    bool counted;
+    if (!peers.admit(peer, counted))
+    {
+#ifdef DEBUG
+      char peer_address[64];
+      format_peer_address(peer_addr, peer_address, sizeof(peer_address));
+      debug(("TCPListener: peer %s has reached its limits; closing connection.", peer_address));
+#endif
+      close(streamfd);
+      return;
+    }
     try
     {
-      new connection_handlerT(mysched, streamfd, sin);
+      new connection_handlerT(mysched, streamfd, peer_addr, counted);
     }
     catch (const std::exception& e)
     {
       close(streamfd);
+      if (counted)
+        peers.release(peer);
       error("TCPListener: caught exception while creating connection handler: %s", e.what());
     }
     catch (...)
     {
       close(streamfd);
+      if (counted)
+        peers.release(peer);
       error("TCPListener: caught unknown exception while creating connection handler");
     }
   }
@@ -124,8 +326,8 @@ private:
 
   scheduler&   mysched;
   int          sockfd;
-  sockaddr_in  sin;
-  socklen_t    sin_size;
+  int          family;
+  std::string  description;
 };
 
 #endif // TCP_LISTENER_HH_INCLUDED
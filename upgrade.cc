@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include "upgrade.hh"
+#include "system-error.hh"
+#include "log.hh"
+
+using namespace std;
+
+// The number of seconds a new server has to report that it's up.
+
+static const int ready_timeout = 30;
+
+binary_upgrade::binary_upgrade(scheduler& sched)
+    : mysched(sched), args(0), helper(-1), helper_fd(-1), state(IDLE)
+{
+}
+
+binary_upgrade::~binary_upgrade()
+{
+  if (helper_fd >= 0)
+  {
+    if (state == STARTED)
+      mysched.remove_handler(helper_fd);
+    close(helper_fd);
+  }
+}
+
+void binary_upgrade::set_command(char** argv)
+{
+  args = argv;
+  path = argv[0];
+  char resolved[PATH_MAX];
+  if (path.find('/') != string::npos && realpath(path.c_str(), resolved) != 0)
+    path = resolved;
+}
+
+void binary_upgrade::start_helper(int listen_fd)
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    throw system_error("socketpair() failed");
+  if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1 || fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1)
+  {
+    close(fds[0]);
+    close(fds[1]);
+    throw system_error("cannot set up socket to the upgrade helper");
+  }
+
+  helper = fork();
+  if (helper == -1)
+  {
+    close(fds[0]);
+    close(fds[1]);
+    throw system_error("fork() failed");
+  }
+  if (helper == 0)
+  {
+    close(fds[0]);
+    run_helper(fds[1], listen_fd);
+    _exit(0);
+  }
+
+  close(fds[1]);
+  helper_fd = fds[0];
+}
+
+void binary_upgrade::start()
+{
+  if (state == STARTED)
+  {
+    info("An upgrade is in progress already; ignoring the request.");
+    return;
+  }
+  if (helper_fd < 0)
+    throw runtime_error("the upgrade helper has gone");
+  if (write(helper_fd, "u", 1) != 1)
+    throw system_error("cannot ask the upgrade helper for a new server");
+
+  state = STARTED;
+  scheduler::handler_properties prop;
+  prop.poll_events = POLLIN;
+  mysched.register_handler(helper_fd, *this, prop);
+}
+
+void binary_upgrade::report_ready()
+{
+  const char* fd = getenv(READY_FD_VARIABLE);
+  if (!fd)
+    return;
+  int ready_fd = atoi(fd);
+  if (write(ready_fd, "1", 1) != 1)
+    error("Cannot report to the server that started us: %s", strerror(errno));
+  close(ready_fd);
+  unsetenv(READY_FD_VARIABLE);
+}
+
+void binary_upgrade::fd_is_readable(int)
+{
+  char c;
+  ssize_t rc = read(helper_fd, &c, 1);
+  if (rc == 1)
+    finish(c == '1' ? SUCCEEDED : FAILED);
+  else if (rc == 0 || (errno != EINTR && errno != EAGAIN))
+    helper_has_gone();
+}
+
+void binary_upgrade::finish(status_t result)
+{
+  mysched.remove_handler(helper_fd);
+  state = result;
+  if (result == SUCCEEDED)
+    info("The new server has taken over; finishing the open requests.");
+  else
+    error("The new server failed to start; carrying on.");
+}
+
+void binary_upgrade::helper_has_gone()
+{
+  finish(FAILED);
+  close(helper_fd);
+  helper_fd = -1;
+  waitpid(helper, 0, 0);
+  error("The upgrade helper has gone; SIGUSR2 won't work anymore.");
+}
+
+void binary_upgrade::fd_is_writable(int)
+{
+  throw logic_error("this routine should not have been called");
+}
+
+void binary_upgrade::read_timeout(int)
+{
+  throw logic_error("this routine should not have been called");
+}
+
+void binary_upgrade::write_timeout(int)
+{
+  throw logic_error("this routine should not have been called");
+}
+
+void binary_upgrade::error_condition(int)
+{
+  helper_has_gone();
+}
+
+void binary_upgrade::pollhup(int fd)
+{
+  fd_is_readable(fd);
+}
+
+/*
+   The helper waits for us to ask for a new server, runs it, and
+   answers "1" once the server is up or "0" if it isn't. It exits when
+   we do. It keeps the signal handlers it has inherited, which do
+   nothing but set flags it never looks at, so that signals meant for
+   the server don't kill it; exec() resets them for the new server.
+*/
+
+void binary_upgrade::run_helper(int sock, int listen_fd)
+{
+  for (;;)
+  {
+    char c;
+    ssize_t rc = read(sock, &c, 1);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc <= 0)
+      return;
+    char result = run_new_server(listen_fd) ? '1' : '0';
+    while (write(sock, &result, 1) == -1)
+      if (errno != EINTR)
+        return;
+  }
+}
+
+bool binary_upgrade::run_new_server(int listen_fd)
+{
+  int fds[2];
+  if (pipe(fds) == -1)
+  {
+    error("Cannot start the new server: pipe() failed: %s", strerror(errno));
+    return false;
+  }
+
+  pid_t child = fork();
+  if (child == -1)
+  {
+    error("Cannot start the new server: fork() failed: %s", strerror(errno));
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (child == 0)
+  {
+    // The new server must not hold on to anything but the listening
+    // socket and its end of the pipe.
+
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    for (int fd = 3; fd < max_fd; ++fd)
+      if (fd != listen_fd && fd != fds[1])
+        close(fd);
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%d", listen_fd);
+    setenv(LISTEN_FD_VARIABLE, buf, 1);
+    snprintf(buf, sizeof(buf), "%d", fds[1]);
+    setenv(READY_FD_VARIABLE, buf, 1);
+    execvp(path.c_str(), args);
+    _exit(127);
+  }
+  close(fds[1]);
+  info("Started '%s' as process %d to take over.", path.c_str(), static_cast<int>(child));
+
+  // Wait for the report. A server that exits or closes the pipe
+  // without it has failed, and so has one that takes too long.
+
+  time_t deadline = time(0) + ready_timeout;
+  ssize_t rc = -1;
+  for (;;)
+  {
+    time_t now = time(0);
+    if (now >= deadline)
+      break;
+    pollfd pfd;
+    pfd.fd      = fds[0];
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+    int n = poll(&pfd, 1, static_cast<int>(deadline - now) * 1000);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    char c;
+    rc = read(fds[0], &c, 1);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    break;
+  }
+  close(fds[0]);
+  if (rc == 1)
+    return true;
+
+  // The child may still be alive, holding on to the listening socket
+  // without ever accepting on it. Make sure it's gone.
+
+  int status;
+  kill(child, SIGKILL);
+  if (waitpid(child, &status, 0) == child && WIFEXITED(status))
+    error("Process %d failed to start (exit code %d).", static_cast<int>(child), WEXITSTATUS(status));
+  else if (rc == -1)
+    error("Process %d didn't report within %d seconds; killed it.", static_cast<int>(child), ready_timeout);
+  else
+    error("Process %d failed to start.", static_cast<int>(child));
+  return false;
+}
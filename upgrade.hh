@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UPGRADE_HH_INCLUDED
+#define UPGRADE_HH_INCLUDED
+
+#include <string>
+#include <sys/types.h>
+#include "libscheduler/scheduler.hh"
+
+// The environment variables by which a server hands its listening
+// socket and a pipe for reporting success to its successor.
+
+#define LISTEN_FD_VARIABLE "HTTPD_LISTEN_FD"
+#define READY_FD_VARIABLE  "HTTPD_READY_FD"
+
+/*
+   This class replaces the running server with a fresh instance of its
+   binary without refusing a single connection. The binary can't be run
+   from within our sandbox, so start_helper() forks a helper process
+   before we change our root directory and drop our privileges. On
+   start(), the helper execs the binary; the new server inherits the
+   listening socket and accepts connections on it as soon as it's up.
+   Then it reports to the helper through a pipe, the helper reports to
+   us, and we stop accepting and finish the requests we have. Until
+   that report arrives, we go on as before -- if the new server fails
+   to start or doesn't report in time, the helper kills it and nothing
+   is lost.
+*/
+
+class binary_upgrade : public scheduler::event_handler
+{
+public:
+  enum status_t { IDLE, STARTED, SUCCEEDED, FAILED };
+
+  explicit binary_upgrade(scheduler& sched);
+  ~binary_upgrade();
+
+  // Remember how to run the binary. A relative path is resolved now,
+  // because we may change our working directory later.
+
+  void set_command(char** argv);
+
+  // Fork the helper that runs new servers with the given listening
+  // socket. It lives until we exit.
+
+  void start_helper(int listen_fd);
+
+  // Have the helper run a new server.
+
+  void start();
+
+  status_t status() const       { return state; }
+
+  // Tell the server that started us that we're up and running, if we
+  // have been started by an upgrade.
+
+  static void report_ready();
+
+private:                      // Don't copy me.
+  binary_upgrade(const binary_upgrade&);
+  binary_upgrade& operator= (const binary_upgrade&);
+
+private:
+  virtual void fd_is_readable(int fd);
+  virtual void fd_is_writable(int);
+  virtual void read_timeout(int);
+  virtual void write_timeout(int);
+  virtual void error_condition(int fd);
+  virtual void pollhup(int fd);
+
+  void finish(status_t result);
+  void helper_has_gone();
+
+  // The helper's side.
+
+  void run_helper(int sock, int listen_fd);
+  bool run_new_server(int listen_fd);
+
+  scheduler&  mysched;
+  std::string path;
+  char**      args;
+  pid_t       helper;
+  int         helper_fd;
+  status_t    state;
+};
+
+#endif // UPGRADE_HH_INCLUDED
@@ -21,6 +21,20 @@
 #include <string>
 #include <stdexcept>
 
+// The value of a hex digit, or -1 if the character isn't one.
+
+inline int hex_digit_value(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  else if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  else if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  else
+    return -1;
+}
+
 /*
    Throwing an exception in case the URL contains a syntax error may
    seem a bit harsh, but consider that this should never happen as all
@@ -32,45 +46,102 @@
 
 inline std::string urldecode(const std::string& input)
 {
-  std::string url = input;
-  for (std::string::iterator i = url.begin(); i != url.end(); ++i)
+  std::string url;
+  url.reserve(input.size());
+  for (std::string::const_iterator i = input.begin(); i != input.end(); ++i)
   {
     if (*i == '+')
-      *i = ' ';
+      url += ' ';
     else if (*i == '%')
     {
-      unsigned char c;
-      std::string::size_type start = i - url.begin();
-
-      if (++i == url.end())
+      int hi, lo;
+      if (input.end() - i < 3 || (hi = hex_digit_value(i[1])) < 0 || (lo = hex_digit_value(i[2])) < 0)
         throw std::runtime_error("Invalid encoded character in URL!");
+      url += static_cast<char>(hi << 4 | lo);
+      i += 2;
+    }
+    else
+      url += *i;
+  }
+  return url;
+}
 
-      if (*i >= '0' && *i <= '9')
-        c = *i - '0';
-      else if (*i >= 'a' && *i <= 'f')
-        c = *i - 'a' + 10;
-      else if (*i >= 'A' && *i <= 'F')
-        c = *i - 'A' + 10;
-      else
-        throw std::runtime_error("Invalid encoded character in URL!");
-      c = c << 4;
+/*
+   Decode an absolute URL path into the caller's buffer and bring it
+   into canonical form on the way: empty segments ("//") and "."
+   segments are dropped, ".." removes the segment before it. The
+   segments are examined after decoding, so "%2e%2e" is a ".." too.
+   The result is NUL-terminated; the function returns its length -- or
+   0 if the path is malformed, contains a NUL character, climbs above
+   the root, or doesn't fit into the buffer. This runs in a single pass
+   and doesn't allocate.
+*/
 
-      if (++i == url.end())
-        throw std::runtime_error("Invalid encoded character in URL!");
+inline size_t urldecode_path(const char* input, size_t len, char* buf, size_t bufsize)
+{
+  const char* const end = input + len;
+  if (input == end || *input != '/' || bufsize < 2)
+    return 0;
 
-      if (*i >= '0' && *i <= '9')
-        c += *i - '0';
-      else if (*i >= 'a' && *i <= 'f')
-        c += *i - 'a' + 10;
-      else if (*i >= 'A' && *i <= 'F')
-        c += *i - 'A' + 10;
-      else
-        throw std::runtime_error("Invalid encoded character in URL!");
+  size_t out       = 0;         // next free position in buf
+  size_t seg_start = 1;         // first character of the current segment
+  buf[out++] = '/';
 
-      url.replace(start, 3, 1, c);
+  for (const char* p = input + 1; ; ++p)
+  {
+    char c;
+    if (p == end)
+      c = '/';
+    else if (*p == '%')
+    {
+      int hi, lo;
+      if (end - p < 3 || (hi = hex_digit_value(p[1])) < 0 || (lo = hex_digit_value(p[2])) < 0)
+        return 0;
+      c = static_cast<char>(hi << 4 | lo);
+      p += 2;
+    }
+    else if (*p == '+')
+      c = ' ';
+    else
+      c = *p;
+
+    if (c == '\0')
+      return 0;
+
+    if (c != '/')
+    {
+      if (out + 1 >= bufsize)
+        return 0;
+      buf[out++] = c;
+      continue;
+    }
+
+    // A segment is complete.
+
+    size_t seg_len = out - seg_start;
+    if (seg_len == 1 && buf[seg_start] == '.')
+      out = seg_start;
+    else if (seg_len == 2 && buf[seg_start] == '.' && buf[seg_start + 1] == '.')
+    {
+      if (seg_start == 1)
+        return 0;
+      out = seg_start - 1;
+      while (buf[out - 1] != '/')
+        --out;
     }
+    else if (seg_len > 0 && p != end)
+    {
+      if (out + 1 >= bufsize)
+        return 0;
+      buf[out++] = '/';
+    }
+    seg_start = out;
+
+    if (p == end)
+      break;
   }
-  return url;
+  buf[out] = '\0';
+  return out;
 }
 
 #endif // URLDECODE_HH_INCLUDED
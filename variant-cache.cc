@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include "variant-cache.hh"
+
+using namespace std;
+
+variant_cache::variant_cache(size_t capacity)
+    : total_size(0), max_size(capacity), hit_count(0), miss_count(0)
+{
+}
+
+variant_cache::cache_key variant_cache::make_key(const string& path, const struct stat& st, unsigned int coding)
+{
+  cache_key key;
+  key.path       = path;
+  key.inode      = st.st_ino;
+  key.size       = st.st_size;
+  key.mtime      = st.st_mtime;
+  key.mtime_nsec = 0;
+#if defined(HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+  key.mtime_nsec = st.st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+  key.mtime_nsec = st.st_mtimespec.tv_nsec;
+#endif
+  key.coding     = coding;
+  return key;
+}
+
+bool variant_cache::same_version(const struct stat& a, const struct stat& b)
+{
+  cache_key ka = make_key(string(), a, 0);
+  cache_key kb = make_key(string(), b, 0);
+  return !(ka < kb) && !(kb < ka);
+}
+
+variant_cache::body_t variant_cache::find(const string& path, const struct stat& st, unsigned int coding)
+{
+  cache_key key = make_key(path, st, coding);
+  map_t::iterator i = entries.find(key);
+  if (i == entries.end())
+  {
+    ++miss_count;
+    return body_t();
+  }
+  ++hit_count;
+  lru.splice(lru.begin(), lru, i->second.lru_pos);
+  return i->second.body;
+}
+
+void variant_cache::insert(const string& path, const struct stat& st, unsigned int coding, const body_t& body)
+{
+  if (!body || body->size() > max_size / 8)
+    return;
+
+  cache_key key = make_key(path, st, coding);
+  map_t::iterator i = entries.find(key);
+  if (i != entries.end())
+  {
+    total_size -= i->second.body->size();
+    lru.erase(i->second.lru_pos);
+    entries.erase(i);
+  }
+
+  evict(max_size - body->size());
+
+  entry_t& entry = entries[key];
+  entry.body     = body;
+  entry.lru_pos  = lru.insert(lru.begin(), key);
+  total_size    += body->size();
+}
+
+void variant_cache::set_capacity(size_t capacity)
+{
+  max_size = capacity;
+  evict(max_size);
+}
+
+// Drop the least recently used entries until the total size is no
+// larger than the given limit.
+
+void variant_cache::evict(size_t limit)
+{
+  while (total_size > limit && !lru.empty())
+  {
+    map_t::iterator i = entries.find(lru.back());
+    total_size -= i->second.body->size();
+    entries.erase(i);
+    lru.pop_back();
+  }
+}
+
+// The global cache of compressed file variants.
+
+variant_cache compressed_variants;
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VARIANT_CACHE_HH_INCLUDED
+#define VARIANT_CACHE_HH_INCLUDED
+
+#include <list>
+#include <map>
+#include <string>
+#include <ctime>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <boost/shared_ptr.hpp>
+
+// This class is a bounded in-memory cache of alternative
+// representations of files, i.e. their compressed versions. Entries are
+// keyed by the file's path, the content coding, and what the entity tag
+// is made of: inode number, size, and modification time with the best
+// resolution the system offers. Once a file changes on disk, its old
+// variants are no longer found and simply age out. When the total size
+// of all entries exceeds the capacity, the least recently used entries
+// are evicted.
+
+class variant_cache
+{
+public:
+  typedef boost::shared_ptr<const std::string> body_t;
+
+  explicit variant_cache(size_t capacity = 0);
+
+  // Look up a variant. Returns an empty pointer if there is none.
+
+  body_t find(const std::string& path, const struct stat& st, unsigned int coding);
+
+  // Add a variant. Bodies larger than an eighth of the capacity are
+  // not worth the space and are silently refused.
+
+  void insert(const std::string& path, const struct stat& st, unsigned int coding, const body_t& body);
+
+  // Whether two stat results describe the same version of a file as
+  // far as the cache is concerned.
+
+  static bool same_version(const struct stat& a, const struct stat& b);
+
+  // Query or change the maximum total size of the cached bodies.
+
+  size_t capacity() const       { return max_size; }
+  void   set_capacity(size_t capacity);
+
+  // Statistics.
+
+  size_t        size() const    { return total_size; }
+  unsigned long hits() const    { return hit_count; }
+  unsigned long misses() const  { return miss_count; }
+
+private:                      // Don't copy me.
+  variant_cache(const variant_cache&);
+  variant_cache& operator= (const variant_cache&);
+
+private:
+  struct cache_key
+  {
+    std::string   path;
+    ino_t         inode;
+    off_t         size;
+    time_t        mtime;
+    unsigned long mtime_nsec;
+    unsigned int  coding;
+
+    bool operator< (const cache_key& rhs) const
+    {
+      if (mtime != rhs.mtime)
+        return mtime < rhs.mtime;
+      if (mtime_nsec != rhs.mtime_nsec)
+        return mtime_nsec < rhs.mtime_nsec;
+      if (size != rhs.size)
+        return size < rhs.size;
+      if (inode != rhs.inode)
+        return inode < rhs.inode;
+      if (coding != rhs.coding)
+        return coding < rhs.coding;
+      return path < rhs.path;
+    }
+  };
+
+  static cache_key make_key(const std::string& path, const struct stat& st, unsigned int coding);
+  typedef std::list<cache_key> lru_t;
+  struct entry_t
+  {
+    body_t          body;
+    lru_t::iterator lru_pos;
+  };
+  typedef std::map<cache_key, entry_t> map_t;
+
+  void evict(size_t limit);
+
+  map_t         entries;
+  lru_t         lru;
+  size_t        total_size;
+  size_t        max_size;
+  unsigned long hit_count;
+  unsigned long miss_count;
+};
+
+extern variant_cache compressed_variants;
+
+#endif // VARIANT_CACHE_HH_INCLUDED
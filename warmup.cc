@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "warmup.hh"
+#include "gzip-encoder.hh"
+#include "variant-cache.hh"
+#include "HTTPRequest.hh"
+#include "system-error.hh"
+#include "config.hh"
+#include "log.hh"
+
+using namespace std;
+
+// The number of files we remember as hot, and the number of files we
+// warm per iteration of the main loop.
+
+static const size_t max_hot_files  = 4096;
+static const size_t files_per_step = 4;
+
+// The number of bytes we compress per iteration of the main loop.
+
+static const size_t compress_bytes_per_step = 64 * 1024;
+
+// A file whose gzipped variant is being made.
+
+struct cache_warmer::compression
+{
+  compression(const string& filename_, int fd_, const struct stat& st_)
+      : filename(filename_), fd(fd_), st(st_), offset(0)
+  {
+  }
+  ~compression()                { close(fd); }
+
+  string        filename;
+  int           fd;
+  struct stat   st;
+  off_t         offset;
+#ifdef HAVE_LIBZ
+  gzip_encoder  encoder;
+#endif
+  string        body;
+};
+
+// Manifest entries must stay below the document root.
+
+static bool is_relative_path(const string& file)
+{
+  if (file.empty() || file[0] == '/')
+    return false;
+  for (size_t start = 0; ; )
+  {
+    size_t end = file.find('/', start);
+    if (file.compare(start, end - start, "..") == 0)
+      return false;
+    if (end == string::npos)
+      return true;
+    start = end + 1;
+  }
+}
+
+
+void cache_warmer::open_manifest(const string& path)
+{
+  manifest_path = path;
+  manifest_fd   = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (manifest_fd == -1)
+    throw system_error(string("cannot open warm-up manifest '") + path + "'");
+}
+
+void cache_warmer::load()
+{
+  string contents;
+  char buf[16384];
+  ssize_t rc;
+  while ((rc = pread(manifest_fd, buf, sizeof(buf), contents.size())) != 0)
+  {
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      info("Cannot read warm-up manifest '%s': %s", manifest_path.c_str(), strerror(errno));
+      return;
+    }
+    contents.append(buf, rc);
+  }
+  istringstream manifest(contents);
+  string line;
+  while (getline(manifest, line))
+  {
+    if (!line.empty() && line[line.size() - 1] == '\r')
+      line.erase(line.size() - 1);
+    if (line.empty() || line[0] == '#')
+      continue;
+    pending.push_back(line);
+  }
+  if (!pending.empty())
+    info("Warming the caches with %lu files from '%s'.",
+         static_cast<unsigned long>(pending.size()), manifest_path.c_str());
+}
+
+cache_warmer::~cache_warmer()
+{
+  stop_compressing();
+  if (manifest_fd >= 0)
+    close(manifest_fd);
+}
+
+bool cache_warmer::step()
+{
+  if (compressing)
+    compress_chunk();
+  else
+  {
+    for (size_t i = 0; i < files_per_step && !pending.empty() && !compressing; ++i)
+    {
+      if (warm(pending.front()))
+        warmed_files.push_back(pending.front());
+      pending.pop_front();
+    }
+  }
+  return !done();
+}
+
+bool cache_warmer::warm(const string& file)
+{
+  if (!is_relative_path(file))
+  {
+    info("Ignoring warm-up manifest entry '%s', which is not below the document root.", file.c_str());
+    return false;
+  }
+  string filename = config->document_root + "/" + file;
+  struct stat st;
+  if (stat(filename.c_str(), &st) == -1 || !S_ISREG(st.st_mode))
+    return false;
+  int fd = open(filename.c_str(), O_RDONLY, 0);
+  if (fd == -1)
+    return false;
+
+  // The kernel reads the file in the background.
+
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+
+  // Compressing has to be done by us. It's left to the following
+  // steps, a chunk at a time; the results are bounded by the variant
+  // cache.
+
+#ifdef HAVE_LIBZ
+  if (config->compress && st.st_size >= min_compressible_size &&
+      st.st_size <= static_cast<off_t>(compressed_variants.capacity() / 8) &&
+      config->is_compressible(config->get_content_type(filename.c_str())))
+  {
+    compressing = new compression(filename, fd, st);
+    return true;
+  }
+#endif
+
+  close(fd);
+  return true;
+}
+
+void cache_warmer::compress_chunk()
+{
+#ifdef HAVE_LIBZ
+  try
+  {
+    char buf[16384];
+    for (size_t n = 0; n < compress_bytes_per_step; n += sizeof(buf))
+    {
+      ssize_t rc = pread(compressing->fd, buf, sizeof(buf), compressing->offset);
+      if (rc < 0)
+        throw system_error(string("pread() from file '") + compressing->filename + "' failed");
+      compressing->offset += rc;
+      compressing->encoder.encode(buf, rc, compressing->body, rc == 0);
+      if (rc == 0)
+      {
+        // Don't cache what we read from a file that has been changed
+        // in the meantime.
+
+        struct stat st;
+        if (fstat(compressing->fd, &st) == 0 && variant_cache::same_version(st, compressing->st))
+        {
+          string* body = new string;
+          variant_cache::body_t owner(body);
+          body->swap(compressing->body);
+          compressed_variants.insert(compressing->filename, compressing->st, CODING_GZIP, owner);
+        }
+        stop_compressing();
+        return;
+      }
+    }
+  }
+  catch (const exception& e)
+  {
+    info("Cannot compress '%s' while warming the caches: %s", compressing->filename.c_str(), e.what());
+    stop_compressing();
+  }
+#endif
+}
+
+void cache_warmer::stop_compressing()
+{
+  delete compressing;
+  compressing = 0;
+}
+
+void cache_warmer::touch(const string& file)
+{
+  map_t::iterator i = hot.find(file);
+  if (i != hot.end())
+  {
+    lru.splice(lru.begin(), lru, i->second);
+    return;
+  }
+  lru.push_front(file);
+  hot[file] = lru.begin();
+  if (lru.size() > max_hot_files)
+  {
+    hot.erase(lru.back());
+    lru.pop_back();
+  }
+}
+
+/*
+   We may not be allowed to create files next to the manifest anymore,
+   so it's rewritten in place rather than replaced.
+*/
+
+void cache_warmer::save() const
+{
+  ostringstream out;
+  size_t count = 0;
+  for (lru_t::const_iterator i = lru.begin(); i != lru.end(); ++i, ++count)
+    out << *i << '\n';
+  deque<string> older(warmed_files);
+  older.insert(older.end(), pending.begin(), pending.end());
+  for (deque<string>::const_iterator i = older.begin(); i != older.end() && count < max_hot_files; ++i)
+  {
+    if (hot.find(*i) == hot.end())
+    {
+      out << *i << '\n';
+      ++count;
+    }
+  }
+
+  string contents = out.str();
+  if (ftruncate(manifest_fd, 0) == -1)
+    throw system_error(string("cannot truncate warm-up manifest '") + manifest_path + "'");
+  for (size_t written = 0; written < contents.size(); )
+  {
+    ssize_t rc = pwrite(manifest_fd, contents.data() + written, contents.size() - written, written);
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      throw system_error(string("cannot write warm-up manifest '") + manifest_path + "'");
+    }
+    written += rc;
+  }
+  info("Wrote %lu files to warm-up manifest '%s'.", static_cast<unsigned long>(count), manifest_path.c_str());
+}
+
+cache_warmer warmer;
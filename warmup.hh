@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2001-2016 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WARMUP_HH_INCLUDED
+#define WARMUP_HH_INCLUDED
+
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+
+// This class remembers the files the server has been asked for
+// recently and warms the caches with them after a restart. The list is
+// kept in a manifest file with one "hostname/path" per line, relative
+// to the document root; lines starting with '#' are ignored.
+//
+// Warming a file means to resolve and open it and to ask the kernel to
+// read it into the page cache. If we compress on the fly, the gzipped
+// variant is put into the variant cache, too. The work is done a few
+// files -- or a few kilobytes of compression -- at a time from the main
+// loop, so that peers don't have to wait for it.
+
+class cache_warmer
+{
+public:
+  cache_warmer() : manifest_fd(-1), compressing(0) { }
+  ~cache_warmer();
+
+  // Open the manifest, creating it if need be. This must happen before
+  // we change our root directory and drop our privileges, so that we
+  // can still write it on shutdown.
+
+  void open_manifest(const std::string& path);
+
+  // Read the manifest. An empty file is not an error; there's nothing
+  // to warm then.
+
+  void load();
+
+  // Warm the next few files of the manifest, or compress the next
+  // chunk of the current one. Returns true if there is more to do.
+
+  bool step();
+
+  bool done() const             { return pending.empty() && !compressing; }
+  size_t warmed() const         { return warmed_files.size(); }
+
+  // Note that a file -- given relative to the document root -- has
+  // been served.
+
+  void touch(const std::string& file);
+
+  // Write the most recently served files to the manifest, followed by
+  // the files of the previous manifest that haven't been asked for --
+  // except those we couldn't find --, up to the size limit of the hot
+  // set.
+
+  void save() const;
+
+private:                      // Don't copy me.
+  cache_warmer(const cache_warmer&);
+  cache_warmer& operator= (const cache_warmer&);
+
+private:
+  bool warm(const std::string& file);
+  void compress_chunk();
+  void stop_compressing();
+
+  struct compression;
+
+  typedef std::list<std::string> lru_t;
+  typedef std::map<std::string, lru_t::iterator> map_t;
+
+  std::deque<std::string>  pending;
+  std::deque<std::string>  warmed_files;
+  lru_t                    lru;
+  map_t                    hot;
+  std::string              manifest_path;
+  int                      manifest_fd;
+  compression*             compressing;
+};
+
+extern cache_warmer warmer;
+
+#endif // WARMUP_HH_INCLUDED